@@ -26,7 +26,10 @@ namespace labhelper
 		}
 	}
 
-	bool Texture::load(const std::string& _directory, const std::string& _filename, int _components)
+	bool Texture::load(const std::string& _directory,
+	                   const std::string& _filename,
+	                   int _components,
+	                   bool upload_to_gpu)
 	{
 		filename = file::normalise(_filename);
 		directory = file::normalise(_directory);
@@ -39,11 +42,15 @@ namespace labhelper
 				<< "\n";
 			exit(1);
 		}
+		n_components = _components;
+		if (!upload_to_gpu)
+		{
+			return true;
+		}
 		glGenTextures(1, &gl_id_internal);
 		gl_id = gl_id_internal;
 		glBindTexture(GL_TEXTURE_2D, gl_id_internal);
 		GLenum format, internal_format;
-		n_components = _components;
 		if (_components == 1)
 		{
 			format = GL_R;
@@ -113,13 +120,16 @@ namespace labhelper
 			if (material.m_emission_texture.valid)
 				material.m_emission_texture.free();
 		}
-		glDeleteBuffers(1, &m_positions_bo);
-		glDeleteBuffers(1, &m_normals_bo);
-		glDeleteBuffers(1, &m_texture_coordinates_bo);
+		if (m_vaob)
+		{
+			glDeleteBuffers(1, &m_positions_bo);
+			glDeleteBuffers(1, &m_normals_bo);
+			glDeleteBuffers(1, &m_texture_coordinates_bo);
+		}
 	}
 
 
-	Model* loadModelFromOBJ(std::string path)
+	Model* loadModelFromOBJ(std::string path, bool upload_to_gpu)
 	{
 		std::string filename, extension, directory;
 
@@ -167,27 +177,27 @@ namespace labhelper
 			material.m_color = glm::vec3(m.diffuse[0], m.diffuse[1], m.diffuse[2]);
 			if (m.diffuse_texname != "")
 			{
-				material.m_color_texture.load(directory, m.diffuse_texname, 4);
+				material.m_color_texture.load(directory, m.diffuse_texname, 4, upload_to_gpu);
 			}
 			material.m_metalness = m.metallic;
 			if (m.metallic_texname != "")
 			{
-				material.m_metalness_texture.load(directory, m.metallic_texname, 1);
+				material.m_metalness_texture.load(directory, m.metallic_texname, 1, upload_to_gpu);
 			}
 			material.m_fresnel = m.specular[0];
 			if (m.specular_texname != "")
 			{
-				material.m_fresnel_texture.load(directory, m.specular_texname, 1);
+				material.m_fresnel_texture.load(directory, m.specular_texname, 1, upload_to_gpu);
 			}
 			material.m_shininess = m.roughness;
 			if (m.roughness_texname != "")
 			{
-				material.m_shininess_texture.load(directory, m.roughness_texname, 1);
+				material.m_shininess_texture.load(directory, m.roughness_texname, 1, upload_to_gpu);
 			}
 			material.m_emission = glm::vec3(m.emission[0], m.emission[1], m.emission[2]);
 			if (m.emissive_texname != "")
 			{
-				material.m_emission_texture.load(directory, m.emissive_texname, 4);
+				material.m_emission_texture.load(directory, m.emissive_texname, 4, upload_to_gpu);
 			}
 			material.m_transparency = m.transmittance[0];
 			material.m_ior = m.ior;
@@ -345,6 +355,11 @@ namespace labhelper
 		///////////////////////////////////////////////////////////////////////
 		// Upload to GPU
 		///////////////////////////////////////////////////////////////////////
+		if (!upload_to_gpu)
+		{
+			std::cout << "done.\n";
+			return model;
+		}
 		glGenVertexArrays(1, &model->m_vaob);
 		glBindVertexArray(model->m_vaob);
 		glGenBuffers(1, &model->m_positions_bo);
@@ -18,7 +18,10 @@ namespace labhelper
 		uint8_t* data;
 		uint8_t n_components = 4;
 
-		bool load(const std::string& directory, const std::string& filename, int nof_components);
+		bool load(const std::string& directory,
+		          const std::string& filename,
+		          int nof_components,
+		          bool upload_to_gpu = true);
 		glm::vec4 sample(glm::vec2 uv) const;
 		void free();
 	};
@@ -72,15 +75,17 @@ namespace labhelper
 		std::vector<glm::vec3> m_positions;
 		std::vector<glm::vec3> m_normals;
 		std::vector<glm::vec2> m_texture_coordinates;
-		// Buffers on GPU
-		uint32_t m_positions_bo;
-		uint32_t m_normals_bo;
-		uint32_t m_texture_coordinates_bo;
+		// Buffers on GPU (zero if the model was loaded without a GL context)
+		uint32_t m_positions_bo = 0;
+		uint32_t m_normals_bo = 0;
+		uint32_t m_texture_coordinates_bo = 0;
 		// Vertex Array Object
-		uint32_t m_vaob;
+		uint32_t m_vaob = 0;
 	};
 
-	Model* loadModelFromOBJ(std::string filename);
+	// Pass upload_to_gpu = false to only fill the CPU buffers, e.g. when
+	// there is no GL context (as in the pathtracer's batch mode).
+	Model* loadModelFromOBJ(std::string filename, bool upload_to_gpu = true);
 	void saveModelToOBJ(Model* model, std::string filename);
 	void saveModelMaterialsToMTL(Model* model, std::string filename);
 	void freeModel(Model* model);
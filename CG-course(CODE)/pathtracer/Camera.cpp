@@ -0,0 +1,137 @@
+#include "Camera.h"
+#include "Pathtracer.h"
+#include "sampling.h"
+#include <algorithm>
+#include <cmath>
+
+using namespace glm;
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// Sub-pixel strata in the order of a 4x4 Bayer matrix, as x + 4 * y
+///////////////////////////////////////////////////////////////////////////
+static const uint8_t stratum_order[16] = { 0, 10, 2, 8, 5, 15, 7, 13, 1, 11, 3, 9, 4, 14, 6, 12 };
+
+void Camera::setup(const mat4& V, const mat4& P, int width, int height)
+{
+	const mat4 inverse_V = inverse(V);
+	const mat4 inverse_PV = inverse(P * V);
+	origin = vec3(inverse_V[3]);
+	right = normalize(vec3(inverse_V[0]));
+	up = normalize(vec3(inverse_V[1]));
+	forward = -normalize(vec3(inverse_V[2]));
+
+	///////////////////////////////////////////////////////////////////////
+	// Points on the far plane are an affine function of the NDC
+	// coordinates, so three of them give the whole frustum
+	///////////////////////////////////////////////////////////////////////
+	auto unproject = [&](float x, float y) {
+		vec4 p = inverse_PV * vec4(x, y, 1.0f, 1.0f);
+		return vec3(p) / p.w - origin;
+	};
+	const vec3 p00 = unproject(-1.0f, -1.0f);
+	const vec3 p10 = unproject(1.0f, -1.0f);
+	const vec3 p01 = unproject(-1.0f, 1.0f);
+	const float far_distance = dot(p00, forward);
+	corner = p00 / far_distance;
+	pixel_dx = (p10 - p00) / (far_distance * float(width));
+	pixel_dy = (p01 - p00) / (far_distance * float(height));
+}
+
+void Camera::generateRays(int x0, int y, int count, uint32_t sample_index, Ray* rays) const
+{
+	const int batch_size = 16;
+	// Film positions and offsets on the lens
+	float px[batch_size], py[batch_size], lx[batch_size], ly[batch_size];
+	float ox[batch_size], oy[batch_size], oz[batch_size];
+	float dx[batch_size], dy[batch_size], dz[batch_size];
+
+	for(int first = 0; first < count; first += batch_size)
+	{
+		const int n = std::min(batch_size, count - first);
+
+		///////////////////////////////////////////////////////////////////
+		// The samples of each pixel. This takes hashing, table lookups and
+		// calls (to the sampler, sin and cos), so it is not vectorized.
+		///////////////////////////////////////////////////////////////////
+		for(int i = 0; i < n; i++)
+		{
+			const uint32_t x = uint32_t(x0 + first + i);
+			const uint32_t key = randomSequenceKey(pixelKey(x, y), sample_index);
+			auto value = [&](uint32_t dimension) {
+				return sampler ? sampler->get(x, y, sample_index, dimension) : randomSequenceValue(key, dimension);
+			};
+			px[i] = float(x);
+			py[i] = float(y);
+			if(jitter && sampler)
+			{
+				px[i] += value(0);
+				py[i] += value(1);
+			}
+			else if(jitter)
+			{
+				// Consecutive samples of a pixel go through the strata in order,
+				// from a start that differs per pixel
+				const uint32_t stratum = stratum_order[(sample_index + pcgHash(pixelKey(x, y))) & 15];
+				px[i] += (float(stratum & 3) + value(0)) * 0.25f;
+				py[i] += (float(stratum >> 2) + value(1)) * 0.25f;
+			}
+			if(lens_radius > 0.0f)
+			{
+				// Uniform point on the lens
+				const float r = lens_radius * std::sqrt(value(2));
+				const float phi = 2.0f * M_PI * value(3);
+				lx[i] = r * std::cos(phi);
+				ly[i] = r * std::sin(phi);
+			}
+		}
+
+		///////////////////////////////////////////////////////////////////
+		// The rays, in one branchless loop per kind of camera so that
+		// they are vectorized. The direction through the pixel is first
+		// found in the plane at distance 1.
+		///////////////////////////////////////////////////////////////////
+		if(lens_radius > 0.0f)
+		{
+			// From the point on the lens, aimed at the point in focus
+			for(int i = 0; i < n; i++)
+			{
+				const float ux = lx[i] * right.x + ly[i] * up.x;
+				const float uy = lx[i] * right.y + ly[i] * up.y;
+				const float uz = lx[i] * right.z + ly[i] * up.z;
+				const float d_x = (corner.x + px[i] * pixel_dx.x + py[i] * pixel_dy.x) * focus_distance - ux;
+				const float d_y = (corner.y + px[i] * pixel_dx.y + py[i] * pixel_dy.y) * focus_distance - uy;
+				const float d_z = (corner.z + px[i] * pixel_dx.z + py[i] * pixel_dy.z) * focus_distance - uz;
+				const float inverse_length = 1.0f / std::sqrt(d_x * d_x + d_y * d_y + d_z * d_z);
+				ox[i] = origin.x + ux;
+				oy[i] = origin.y + uy;
+				oz[i] = origin.z + uz;
+				dx[i] = d_x * inverse_length;
+				dy[i] = d_y * inverse_length;
+				dz[i] = d_z * inverse_length;
+			}
+		}
+		else
+		{
+			for(int i = 0; i < n; i++)
+			{
+				const float d_x = corner.x + px[i] * pixel_dx.x + py[i] * pixel_dy.x;
+				const float d_y = corner.y + px[i] * pixel_dx.y + py[i] * pixel_dy.y;
+				const float d_z = corner.z + px[i] * pixel_dx.z + py[i] * pixel_dy.z;
+				const float inverse_length = 1.0f / std::sqrt(d_x * d_x + d_y * d_y + d_z * d_z);
+				ox[i] = origin.x;
+				oy[i] = origin.y;
+				oz[i] = origin.z;
+				dx[i] = d_x * inverse_length;
+				dy[i] = d_y * inverse_length;
+				dz[i] = d_z * inverse_length;
+			}
+		}
+		for(int i = 0; i < n; i++)
+		{
+			rays[first + i] = Ray(vec3(ox[i], oy[i], oz[i]), vec3(dx[i], dy[i], dz[i]));
+		}
+	}
+}
+} // namespace pathtracer
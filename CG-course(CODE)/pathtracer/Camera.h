@@ -0,0 +1,67 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <cstdint>
+#include "embree.h"
+#include "sampling.h"
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// Generates primary rays. The frustum is set up once per pass from the
+// view and projection matrices as a corner direction plus one step per
+// pixel, so a ray costs a few multiply-adds and a normalize instead of a
+// matrix inverse. Rays are generated a row of pixels at a time: the
+// samples of the pixels are drawn first, then the rays are made from them
+// in a branchless loop over plain float arrays that the compiler vectorizes.
+//
+// With jitter, sample n of a pixel lands in one of 4x4 sub-pixel strata,
+// visited in the order of a 4x4 Bayer matrix so that any few consecutive
+// samples are spread over the pixel. With a sampler, the sub-pixel position
+// is its dimensions 0 and 1 instead. With a lens radius > 0, rays start on
+// a thin lens and converge at the focus distance (depth of field), at the
+// position given by dimensions 2 and 3.
+///////////////////////////////////////////////////////////////////////////
+class Camera
+{
+public:
+	bool jitter = false;
+	float lens_radius = 0.0f;
+	float focus_distance = 10.0f;
+	// Null for stratified random numbers
+	const Sampler* sampler = nullptr;
+
+	void setup(const glm::mat4& V, const glm::mat4& P, int width, int height);
+
+	// The primary rays of the `count` pixels (x0, y) to (x0 + count - 1, y)
+	// for sample `sample_index`
+	void generateRays(int x0, int y, int count, uint32_t sample_index, Ray* rays) const;
+
+	Ray generateRay(int x, int y, uint32_t sample_index) const
+	{
+		Ray ray;
+		generateRays(x, y, 1, sample_index, &ray);
+		return ray;
+	}
+
+	// Linear depth of a point: its distance in front of the camera, along
+	// the view direction
+	float viewDepth(const glm::vec3& p) const
+	{
+		return glm::dot(p - origin, forward);
+	}
+
+	// True if every sample of a pixel gets the same ray
+	bool isDeterministic() const
+	{
+		return !jitter && lens_radius == 0.0f;
+	}
+
+private:
+	glm::vec3 origin;
+	// Direction to the corner of pixel (0, 0) and the steps to the next
+	// pixel, scaled so that they lie in the plane at distance 1
+	glm::vec3 corner, pixel_dx, pixel_dy;
+	// Camera axes, for positions on the lens and depths
+	glm::vec3 right, up, forward;
+};
+} // namespace pathtracer
@@ -0,0 +1,234 @@
+#include "Denoiser.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <omp.h>
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+static const float B3_KERNEL[5] = { 1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+static const float MIN_ALBEDO = 0.01f;
+
+static float luminance(float r, float g, float b)
+{
+	return 0.2126f * r + 0.7152f * g + 0.0722f * b;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// e^x for x <= 0, to a relative error below 1e-6 for x > -10 (the error of
+// rounding x / ln 2 grows with |x|), and no smaller than 2^-126 ~ e^-87.
+// Unlike std::exp this is inlined without calls, so the loops using it
+// vectorize. e^x = 2^t = 2^i * 2^f, with the integer i nearest to
+// t and a polynomial (from Cephes' exp2f) for 2^f, f in [-0.5, 0.5]. 2^i
+// is built directly in the exponent bits of a float.
+///////////////////////////////////////////////////////////////////////////
+static inline float negativeExp(float x)
+{
+	const float t = std::max(x * 1.44269504088896341f, -126.0f);
+	const int32_t i = int32_t(t - 0.5f);
+	const float f = t - float(i);
+	float p = 1.535336188319500e-4f;
+	p = 1.339887440266574e-3f + f * p;
+	p = 9.618437357674640e-3f + f * p;
+	p = 5.550332471162809e-2f + f * p;
+	p = 2.402264791363012e-1f + f * p;
+	p = 6.931472028550421e-1f + f * p;
+	p = 1.0f + f * p;
+	const int32_t bits = (i + 127) << 23;
+	float scale;
+	std::memcpy(&scale, &bits, sizeof(scale));
+	return p * scale;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Split the image into planes, divided by the albedo
+///////////////////////////////////////////////////////////////////////////
+void Denoiser::prepare(const Image& image, const AOVs& aovs)
+{
+	width = image.width;
+	height = image.height;
+	const int num_pixels = width * height;
+	for(auto* plane : { &r, &g, &b, &variance, &next_r, &next_g, &next_b, &next_variance, &luminance_plane, &depth,
+	                    &normal_x, &normal_y, &normal_z })
+	{
+		plane->resize(num_pixels);
+	}
+
+#pragma omp parallel for schedule(static)
+	for(int i = 0; i < num_pixels; i++)
+	{
+		const vec3 albedo = max(aovs.albedo[i], vec3(MIN_ALBEDO));
+		const vec3 c = image.data[i] / albedo;
+		r[i] = c.r;
+		g[i] = c.g;
+		b[i] = c.b;
+		depth[i] = aovs.depth[i];
+		normal_x[i] = aovs.normal[i].x;
+		normal_y[i] = aovs.normal[i].y;
+		normal_z[i] = aovs.normal[i].z;
+
+		// The variance of the mean luminance, scaled like the color. With
+		// fewer than two samples nothing is known, so anything goes.
+		const float n = image.sample_counts[i];
+		const float l = luminance(image.data[i].r, image.data[i].g, image.data[i].b);
+		const float albedo_luminance = luminance(albedo.r, albedo.g, albedo.b);
+		variance[i] = n > 1.0f ? std::max(0.0f, image.luminance_squares[i] - l * l) / (n - 1.0f)
+		                             / (albedo_luminance * albedo_luminance) :
+		                         1e6f;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Add one tap of the kernel to the sums of a row of pixels p, from the
+// pixels q = p + dx of row q it reads, for the x where both are in the
+// image. The sums are restrict parameters: compilers only
+// vectorize a loop over this many arrays if they need not check at runtime
+// that the ones written do not overlap the others.
+///////////////////////////////////////////////////////////////////////////
+struct PlaneRow
+{
+	const float *r, *g, *b, *variance, *luminance, *depth, *normal_x, *normal_y, *normal_z;
+};
+
+static void addTap(int width, int dx, float kernel, float inverse_depth_sigma, const PlaneRow& p, const PlaneRow& q,
+                   const float* __restrict inverse_sigma_luminance, float* __restrict sum_r,
+                   float* __restrict sum_g, float* __restrict sum_b, float* __restrict sum_variance,
+                   float* __restrict sum_weight)
+{
+	const int x_begin = std::max(0, -dx), x_end = std::min(width, width - dx);
+	for(int x = x_begin; x < x_end; x++)
+	{
+		const int qx = x + dx;
+		float cosine =
+		    p.normal_x[x] * q.normal_x[qx] + p.normal_y[x] * q.normal_y[qx] + p.normal_z[x] * q.normal_z[qx];
+		cosine = cosine > 0.0f ? cosine : 0.0f;
+		// cosine^128
+		cosine *= cosine;
+		cosine *= cosine;
+		cosine *= cosine;
+		cosine *= cosine;
+		cosine *= cosine;
+		cosine *= cosine;
+		cosine *= cosine;
+		const float depth_difference = std::abs(p.depth[x] - q.depth[qx]) / (p.depth[x] + 1e-4f);
+		float w = kernel * cosine
+		          * negativeExp(-std::abs(p.luminance[x] - q.luminance[qx]) * inverse_sigma_luminance[x]
+		                        - depth_difference * inverse_depth_sigma);
+		w = q.depth[qx] > 0.0f ? w : 0.0f;
+		sum_r[x] += w * q.r[qx];
+		sum_g[x] += w * q.g[qx];
+		sum_b[x] += w * q.b[qx];
+		sum_variance[x] += w * w * q.variance[qx];
+		sum_weight[x] += w;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// One row of one a-trous iteration, with the taps `step` pixels apart
+///////////////////////////////////////////////////////////////////////////
+void Denoiser::filterRow(int y, int step)
+{
+	// The planes from the start of a row
+	auto planeRow = [&](int row) {
+		const int offset = row * width;
+		return PlaneRow{ r.data() + offset,        g.data() + offset,        b.data() + offset,
+			             variance.data() + offset, luminance_plane.data() + offset, depth.data() + offset,
+			             normal_x.data() + offset, normal_y.data() + offset, normal_z.data() + offset };
+	};
+	// Per pixel sums over the taps
+	static thread_local vector<float> sums;
+	sums.assign(6 * width, 0.0f);
+	float* sum_r = &sums[0];
+	float* sum_g = sum_r + width;
+	float* sum_b = sum_g + width;
+	float* sum_variance = sum_b + width;
+	float* sum_weight = sum_variance + width;
+	float* inverse_sigma_luminance = sum_weight + width;
+
+	const int row = y * width;
+	const PlaneRow p = planeRow(y);
+	for(int x = 0; x < width; x++)
+	{
+		inverse_sigma_luminance[x] = 1.0f / (sigma_luminance * std::sqrt(variance[row + x]) + 1e-4f);
+	}
+	for(int ty = -2; ty <= 2; ty++)
+	{
+		const int qy = y + ty * step;
+		if(qy < 0 || qy >= height)
+		{
+			continue;
+		}
+		const PlaneRow q = planeRow(qy);
+		for(int tx = -2; tx <= 2; tx++)
+		{
+			const float kernel = B3_KERNEL[ty + 2] * B3_KERNEL[tx + 2];
+			const float inverse_depth_sigma = 1.0f / (sigma_depth * float(step * (abs(tx) + abs(ty))) + 1e-4f);
+			addTap(width, tx * step, kernel, inverse_depth_sigma, p, q, inverse_sigma_luminance, sum_r, sum_g,
+			       sum_b, sum_variance, sum_weight);
+		}
+	}
+
+	for(int x = 0; x < width; x++)
+	{
+		const int i = row + x;
+		if(depth[i] > 0.0f && sum_weight[x] > 0.0f)
+		{
+			const float inverse_weight = 1.0f / sum_weight[x];
+			next_r[i] = sum_r[x] * inverse_weight;
+			next_g[i] = sum_g[x] * inverse_weight;
+			next_b[i] = sum_b[x] * inverse_weight;
+			next_variance[i] = sum_variance[x] * inverse_weight * inverse_weight;
+		}
+		else
+		{
+			next_r[i] = r[i];
+			next_g[i] = g[i];
+			next_b[i] = b[i];
+			next_variance[i] = variance[i];
+		}
+	}
+}
+
+int Denoiser::denoise(const Image& image, const AOVs& aovs, int iterations, double time_cap, vector<vec3>& output)
+{
+	const double start_time = omp_get_wtime();
+	prepare(image, aovs);
+
+	int iteration = 0;
+	for(; iteration < iterations; iteration++)
+	{
+		if(time_cap > 0.0 && iteration > 0 && omp_get_wtime() - start_time > time_cap)
+		{
+			break;
+		}
+		const int step = 1 << iteration;
+#pragma omp parallel for schedule(static)
+		for(int i = 0; i < width * height; i++)
+		{
+			luminance_plane[i] = luminance(r[i], g[i], b[i]);
+		}
+#pragma omp parallel for schedule(dynamic, 4)
+		for(int y = 0; y < height; y++)
+		{
+			filterRow(y, step);
+		}
+		r.swap(next_r);
+		g.swap(next_g);
+		b.swap(next_b);
+		variance.swap(next_variance);
+	}
+
+	// Put the albedo back
+	output.resize(width * height);
+#pragma omp parallel for schedule(static)
+	for(int i = 0; i < width * height; i++)
+	{
+		output[i] = depth[i] > 0.0f ? vec3(r[i], g[i], b[i]) * max(aovs.albedo[i], vec3(MIN_ALBEDO)) : image.data[i];
+	}
+	return iteration;
+}
+} // namespace pathtracer
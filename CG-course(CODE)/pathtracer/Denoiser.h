@@ -0,0 +1,49 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+#include "Pathtracer.h"
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// Edge-aware a-trous wavelet filter, the spatial part of SVGF
+// ("Spatiotemporal Variance-Guided Filtering", Schied et al. 2017). The
+// accumulation already does the temporal part.
+//
+// The color is divided by the albedo of the primary hit first, so that
+// texture and material detail is not blurred, only the lighting. Then a
+// 5x5 B3 spline kernel is applied a number of times with the taps spread
+// 1, 2, 4, ... pixels apart. Each tap is weighted down when its depth or
+// normal differ (another surface), or when its luminance differs by more
+// than the pixel's standard error says it could from noise alone. The
+// variance is filtered along, so that the luminance test gets stricter
+// as the noise goes away. Escaped (environment) pixels are not filtered.
+//
+// The planes are stored one float array per channel, and every tap is a
+// loop over a row of pixels, so the inner loops vectorize.
+///////////////////////////////////////////////////////////////////////////
+class Denoiser
+{
+public:
+	float sigma_luminance = 4.0f; // In standard errors
+	float sigma_depth = 0.02f; // Relative depth difference per pixel of distance
+
+	// Filter image into output. Stops after the iteration that passes
+	// time_cap seconds (0 = no cap). Returns the number of iterations done.
+	int denoise(const Image& image, const AOVs& aovs, int iterations, double time_cap,
+	            std::vector<glm::vec3>& output);
+
+private:
+	void prepare(const Image& image, const AOVs& aovs);
+	void filterRow(int y, int step);
+
+	int width = 0, height = 0;
+	// Demodulated color and the variance of its luminance, filtered from
+	// the current planes into the next ones
+	std::vector<float> r, g, b, variance;
+	std::vector<float> next_r, next_g, next_b, next_variance;
+	std::vector<float> luminance_plane;
+	// Guides. A depth of 0 means the pixel is not filtered.
+	std::vector<float> depth, normal_x, normal_y, normal_z;
+};
+} // namespace pathtracer
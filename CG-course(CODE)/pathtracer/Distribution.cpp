@@ -0,0 +1,125 @@
+#include "Distribution.h"
+#include <algorithm>
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+void Distribution1D::build(const float* f, int n)
+{
+	function.assign(f, f + n);
+	double sum = 0.0;
+	for(float v : function)
+	{
+		sum += v;
+	}
+	integral_value = float(sum / double(n));
+	if(sum <= 0.0)
+	{
+		function.assign(n, 1.0f);
+		sum = double(n);
+	}
+	average = float(sum / double(n));
+
+	///////////////////////////////////////////////////////////////////////
+	// Scale the bins so that their average is 1, and pair every bin below
+	// 1 with one above, which gives it what it lacks
+	///////////////////////////////////////////////////////////////////////
+	probability.resize(n);
+	alias.resize(n);
+	vector<uint32_t> small, large;
+	vector<double> scaled(n);
+	for(int i = 0; i < n; i++)
+	{
+		scaled[i] = double(function[i]) / double(average);
+		(scaled[i] < 1.0 ? small : large).push_back(i);
+	}
+	while(!small.empty() && !large.empty())
+	{
+		const uint32_t s = small.back(), l = large.back();
+		small.pop_back();
+		large.pop_back();
+		probability[s] = float(scaled[s]);
+		alias[s] = l;
+		scaled[l] -= 1.0 - scaled[s];
+		(scaled[l] < 1.0 ? small : large).push_back(l);
+	}
+	// What is left is 1 up to rounding errors
+	for(uint32_t i : small)
+	{
+		probability[i] = 1.0f;
+		alias[i] = i;
+	}
+	for(uint32_t i : large)
+	{
+		probability[i] = 1.0f;
+		alias[i] = i;
+	}
+}
+
+int Distribution1D::sample(float u) const
+{
+	const int n = int(function.size());
+	const float scaled = u * float(n);
+	const int i = std::min(int(scaled), n - 1);
+	return scaled - float(i) < probability[i] ? i : int(alias[i]);
+}
+
+int Distribution1D::sample(float u, float& x, float& pdf_x) const
+{
+	///////////////////////////////////////////////////////////////////////
+	// What is left of u once the bin is picked is uniform, and is reused
+	// for the position in the bin, so that stratified u give stratified x
+	///////////////////////////////////////////////////////////////////////
+	const int n = int(function.size());
+	const float scaled = u * float(n);
+	const int i = std::min(int(scaled), n - 1);
+	const float remainder = scaled - float(i);
+	int bin;
+	float offset;
+	if(remainder < probability[i])
+	{
+		bin = i;
+		offset = remainder / probability[i];
+	}
+	else
+	{
+		bin = int(alias[i]);
+		offset = (remainder - probability[i]) / (1.0f - probability[i]);
+	}
+	x = (float(bin) + std::min(offset, 0.99999994f)) / float(n);
+	pdf_x = pdf(bin);
+	return bin;
+}
+
+void Distribution2D::build(const float* function, int w, int h)
+{
+	width = w;
+	height = h;
+	rows.resize(height);
+	vector<float> row_integrals(height);
+	for(int y = 0; y < height; y++)
+	{
+		rows[y].build(&function[y * width], width);
+		row_integrals[y] = rows[y].integral();
+	}
+	marginal.build(row_integrals.data(), height);
+}
+
+vec2 Distribution2D::sample(const vec2& u, float& pdf_p) const
+{
+	float y, pdf_y, x, pdf_x;
+	const int row = marginal.sample(u.y, y, pdf_y);
+	rows[row].sample(u.x, x, pdf_x);
+	pdf_p = pdf_y * pdf_x;
+	return vec2(x, y);
+}
+
+float Distribution2D::pdf(const vec2& p) const
+{
+	const int x = std::min(std::max(int(p.x * float(width)), 0), width - 1);
+	const int y = std::min(std::max(int(p.y * float(height)), 0), height - 1);
+	return marginal.pdf(y) * rows[y].pdf(x);
+}
+} // namespace pathtracer
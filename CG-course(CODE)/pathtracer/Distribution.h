@@ -0,0 +1,80 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+#include <cstdint>
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// A piecewise constant distribution over [0, 1), with n equally wide bins
+// weighted by a function. It is sampled in O(1) with an alias table
+// ("A Linear Algorithm for Generating Random Numbers with a Given
+// Distribution", Vose 1991): bin i is picked uniformly, and then either
+// kept, with probability probability[i], or replaced by alias[i].
+///////////////////////////////////////////////////////////////////////////
+class Distribution1D
+{
+public:
+	// Build from the (non-negative) function values of the bins. If they
+	// are all 0, every bin is equally likely.
+	void build(const float* function, int n);
+
+	// The bin that u in [0, 1) picks, and the pdf (per unit of [0, 1)) of
+	// the returned position x in [0, 1), which is within that bin.
+	int sample(float u, float& x, float& pdf) const;
+	int sample(float u) const;
+
+	// The pdf of the bin, per unit of [0, 1)
+	float pdf(int bin) const
+	{
+		return function[bin] / average;
+	}
+	// The probability that the bin is picked
+	float probabilityOf(int bin) const
+	{
+		return function[bin] / (average * float(function.size()));
+	}
+	int size() const
+	{
+		return int(function.size());
+	}
+	// The integral of the function over [0, 1)
+	float integral() const
+	{
+		return integral_value;
+	}
+
+private:
+	std::vector<float> function;
+	std::vector<float> probability;
+	std::vector<uint32_t> alias;
+	float average = 1.0f; // The average that the pdfs are divided by
+	float integral_value = 0.0f;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// A piecewise constant distribution over [0, 1)^2, on a width x height
+// grid. A row is picked from the distribution of the row sums (the
+// marginal), and a column from the distribution of that row.
+///////////////////////////////////////////////////////////////////////////
+class Distribution2D
+{
+public:
+	void build(const float* function, int width, int height);
+
+	// A position in [0, 1)^2 from two uniform numbers, with its pdf per
+	// unit area
+	glm::vec2 sample(const glm::vec2& u, float& pdf) const;
+	float pdf(const glm::vec2& p) const;
+
+	bool empty() const
+	{
+		return rows.empty();
+	}
+
+private:
+	int width = 0, height = 0;
+	Distribution1D marginal;
+	std::vector<Distribution1D> rows;
+};
+} // namespace pathtracer
@@ -0,0 +1,286 @@
+#include "EnvironmentMap.h"
+#include "Pathtracer.h"
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+// Distribution cells per side, at most
+static const int MAX_DISTRIBUTION_SIZE = 512;
+
+///////////////////////////////////////////////////////////////////////////
+// The equal area mapping between the unit sphere and [0, 1]^2. The +z
+// hemisphere is the diamond in the middle of the square and the -z one is
+// folded out to its corners. In the map, z is the world's up (y) axis.
+///////////////////////////////////////////////////////////////////////////
+static inline void sphereToSquare(float dx, float dy, float dz, float& u, float& v)
+{
+	const float x = std::abs(dx), y = std::abs(dy), z = std::abs(dz);
+	const float r = std::sqrt(std::max(0.0f, 1.0f - z));
+	// min / max, or 0 / tiny at the poles
+	const float b = std::min(x, y) / std::max(std::max(x, y), 1e-30f);
+	// atan(b) * 2 / pi
+	float phi = 0.419038818029165735901852432784e-1f + b * -0.251390972343483509333252996350e-1f;
+	phi = 0.881770664775316294736387951347e-1f + b * phi;
+	phi = -0.247333733281268944196501420480f + b * phi;
+	phi = 0.61572017898280213493197203466e-2f + b * phi;
+	phi = 0.636226545274016134946890922156f + b * phi;
+	phi = 0.406758566246788489601959989e-5f + b * phi;
+	phi = x < y ? 1.0f - phi : phi;
+	const float pv = phi * r;
+	const float pu = r - pv;
+	const float fu = dz < 0.0f ? 1.0f - pv : pu;
+	const float fv = dz < 0.0f ? 1.0f - pu : pv;
+	u = 0.5f * (std::copysign(fu, dx) + 1.0f);
+	v = 0.5f * (std::copysign(fv, dy) + 1.0f);
+}
+
+static vec3 squareToSphere(const vec2& p)
+{
+	const float u = 2.0f * p.x - 1.0f, v = 2.0f * p.y - 1.0f;
+	const float up = std::abs(u), vp = std::abs(v);
+	const float signed_distance = 1.0f - (up + vp);
+	const float r = 1.0f - std::abs(signed_distance);
+	const float phi = (r == 0.0f ? 1.0f : (vp - up) / r + 1.0f) * M_PI / 4.0f;
+	const float z = std::copysign(1.0f - r * r, signed_distance);
+	const float s = r * std::sqrt(std::max(0.0f, 2.0f - r * r));
+	return vec3(std::copysign(std::cos(phi), u) * s, std::copysign(std::sin(phi), v) * s, z);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Map the map's (x, y, z) direction components to continuous texel
+// coordinates, for count <= 16 directions. Written as one branchless loop
+// over separate restrict arrays (an array of vec3 is a stride 3 load that
+// only vectorizes two lanes wide), so that it is vectorized.
+///////////////////////////////////////////////////////////////////////////
+static void toTexelCoordinates(const float* __restrict x, const float* __restrict y,
+                               const float* __restrict z, int count, float size, float* __restrict px,
+                               float* __restrict py)
+{
+	for(int i = 0; i < count; i++)
+	{
+		float u, v;
+		sphereToSquare(x[i], y[i], z[i], u, v);
+		px[i] = u * size - 0.5f;
+		py[i] = v * size - 0.5f;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// RGBE: the mantissas are the colors scaled by 2^(8 - e), where 2^e is
+// just above the largest of them
+///////////////////////////////////////////////////////////////////////////
+static uint32_t encodeRGBE(const vec3& c)
+{
+	const float m = std::max(c.r, std::max(c.g, c.b));
+	if(!(m > 1e-32f))
+	{
+		return 0;
+	}
+	int e;
+	frexp(m, &e);
+	if(e + 128 < 1)
+	{
+		return 0;
+	}
+	e = std::min(e, 127);
+	const float scale = ldexp(1.0f, 8 - e);
+	uint32_t rgbe = uint32_t(e + 128) << 24;
+	for(int i = 0; i < 3; i++)
+	{
+		rgbe |= uint32_t(std::min(std::max(c[i] * scale, 0.0f), 255.0f)) << (8 * i);
+	}
+	return rgbe;
+}
+
+// What the mantissas are multiplied by, per exponent
+static struct RGBEScales
+{
+	float scale[256];
+	RGBEScales()
+	{
+		scale[0] = 0.0f;
+		for(int e = 1; e < 256; e++)
+		{
+			scale[e] = ldexp(1.0f, e - 136);
+		}
+	}
+} rgbe_scales;
+
+///////////////////////////////////////////////////////////////////////////
+// Texel (x, y), where x and y may be one texel outside the map. The map
+// wraps around its edges mirrored, since the edges of the square are
+// folded together on the sphere.
+///////////////////////////////////////////////////////////////////////////
+vec3 EnvironmentMap::texel(int x, int y) const
+{
+	if(x < 0)
+	{
+		x = -x - 1;
+		y = size - 1 - y;
+	}
+	else if(x >= size)
+	{
+		x = 2 * size - 1 - x;
+		y = size - 1 - y;
+	}
+	if(y < 0)
+	{
+		x = size - 1 - x;
+		y = -y - 1;
+	}
+	else if(y >= size)
+	{
+		x = size - 1 - x;
+		y = 2 * size - 1 - y;
+	}
+	const uint32_t rgbe = texels[y * size + x];
+	const float scale = rgbe_scales.scale[rgbe >> 24];
+	return vec3(float(rgbe & 0xFF) + 0.5f, float((rgbe >> 8) & 0xFF) + 0.5f, float((rgbe >> 16) & 0xFF) + 0.5f)
+	       * scale;
+}
+
+vec3 EnvironmentMap::bilinear(float px, float py) const
+{
+	const float fx = floor(px), fy = floor(py);
+	const int x = int(fx), y = int(fy);
+	const float tx = px - fx, ty = py - fy;
+	return (1.0f - ty) * ((1.0f - tx) * texel(x, y) + tx * texel(x + 1, y))
+	       + ty * ((1.0f - tx) * texel(x, y + 1) + tx * texel(x + 1, y + 1));
+}
+
+float EnvironmentMap::filteredLuminance(int x, int y) const
+{
+	// The bilinear filter's weight over a texel's area, of the texel and
+	// of its neighbours, per axis
+	static const float weights[3] = { 1.0f / 8.0f, 3.0f / 4.0f, 1.0f / 8.0f };
+	float sum = 0.0f;
+	for(int dy = -1; dy <= 1; dy++)
+	{
+		for(int dx = -1; dx <= 1; dx++)
+		{
+			const vec3 c = texel(x + dx, y + dy);
+			sum += weights[dx + 1] * weights[dy + 1] * (0.2126f * c.r + 0.7152f * c.g + 0.0722f * c.b);
+		}
+	}
+	return sum;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Bilinear lookup in the equirectangular image, wrapping around in u
+///////////////////////////////////////////////////////////////////////////
+static vec3 sampleEquirect(const HDRImage& image, const vec3& wi)
+{
+	const float theta = acos(std::max(-1.0f, std::min(1.0f, wi.y)));
+	float phi = atan2(wi.z, wi.x);
+	if(phi < 0.0f)
+		phi = phi + 2.0f * M_PI;
+	const float px = phi / (2.0f * M_PI) * float(image.width) - 0.5f;
+	const float py = (1.0f - theta / M_PI) * float(image.height) - 0.5f;
+	const float fx = floor(px), fy = floor(py);
+	const float tx = px - fx, ty = py - fy;
+	auto fetch = [&](int x, int y) {
+		x = ((x % image.width) + image.width) % image.width;
+		y = std::min(std::max(y, 0), image.height - 1);
+		const float* c = &image.data[(y * image.width + x) * 3];
+		return vec3(c[0], c[1], c[2]);
+	};
+	const int x = int(fx), y = int(fy);
+	return (1.0f - ty) * ((1.0f - tx) * fetch(x, y) + tx * fetch(x + 1, y))
+	       + ty * ((1.0f - tx) * fetch(x, y + 1) + tx * fetch(x + 1, y + 1));
+}
+
+void EnvironmentMap::build(const HDRImage& equirect)
+{
+	///////////////////////////////////////////////////////////////////////
+	// About as many texels as the image, and a whole number of them per
+	// distribution cell
+	///////////////////////////////////////////////////////////////////////
+	const int texels_per_side = std::max(1, int(ceil(sqrt(double(equirect.width) * double(equirect.height)))));
+	block_size = (texels_per_side + MAX_DISTRIBUTION_SIZE - 1) / MAX_DISTRIBUTION_SIZE;
+	const int distribution_size = (texels_per_side + block_size - 1) / block_size;
+	size = distribution_size * block_size;
+	texels.resize(size_t(size) * size_t(size));
+
+	// Each texel is the average of 2x2 lookups in the image
+#pragma omp parallel for schedule(dynamic, 16)
+	for(int y = 0; y < size; y++)
+	{
+		for(int x = 0; x < size; x++)
+		{
+			vec3 sum = vec3(0.0f);
+			for(int i = 0; i < 4; i++)
+			{
+				const vec2 p = vec2(float(x) + 0.25f + 0.5f * float(i & 1), float(y) + 0.25f + 0.5f * float(i >> 1));
+				const vec3 d = squareToSphere(p / float(size));
+				sum += sampleEquirect(equirect, vec3(d.x, d.z, d.y));
+			}
+			texels[y * size + x] = encodeRGBE(0.25f * sum);
+		}
+	}
+
+	vector<float> function(distribution_size * distribution_size, 0.0f);
+#pragma omp parallel for schedule(dynamic, 1)
+	for(int cy = 0; cy < distribution_size; cy++)
+	{
+		for(int y = cy * block_size; y < (cy + 1) * block_size; y++)
+		{
+			for(int x = 0; x < size; x++)
+			{
+				function[cy * distribution_size + x / block_size] += filteredLuminance(x, y);
+			}
+		}
+	}
+	distribution.build(function.data(), distribution_size, distribution_size);
+}
+
+vec3 EnvironmentMap::lookup(const vec3& wi) const
+{
+	float px, py;
+	toTexelCoordinates(&wi.x, &wi.z, &wi.y, 1, float(size), &px, &py);
+	return bilinear(px, py);
+}
+
+void EnvironmentMap::lookup(const vec3* wi, int count, vec3* radiance) const
+{
+	float x[16], y[16], z[16], px[16], py[16];
+	for(int begin = 0; begin < count; begin += 16)
+	{
+		const int n = std::min(16, count - begin);
+		// In the map, z is the world's up (y) axis
+		for(int i = 0; i < n; i++)
+		{
+			x[i] = wi[begin + i].x;
+			y[i] = wi[begin + i].z;
+			z[i] = wi[begin + i].y;
+		}
+		toTexelCoordinates(x, y, z, n, float(size), px, py);
+		for(int i = 0; i < n; i++)
+		{
+			radiance[begin + i] = bilinear(px[i], py[i]);
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// The square maps to the sphere's 4 pi of solid angle with a constant
+// Jacobian, so the pdf per solid angle is that per unit area over 4 pi
+///////////////////////////////////////////////////////////////////////////
+vec3 EnvironmentMap::sample(const vec2& u, float& pdf_wi) const
+{
+	float uv_pdf;
+	const vec3 d = squareToSphere(distribution.sample(u, uv_pdf));
+	pdf_wi = uv_pdf / (4.0f * M_PI);
+	return vec3(d.x, d.z, d.y);
+}
+
+float EnvironmentMap::pdf(const vec3& wi) const
+{
+	float u, v;
+	sphereToSquare(wi.x, wi.z, wi.y, u, v);
+	return distribution.pdf(vec2(u, v)) / (4.0f * M_PI);
+}
+} // namespace pathtracer
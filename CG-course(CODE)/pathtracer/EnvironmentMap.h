@@ -0,0 +1,60 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+#include <cstdint>
+#include "HDRImage.h"
+#include "Distribution.h"
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// The environment, resampled from an equirectangular image into an equal
+// area octahedral map ("Fast Equal-Area Mapping of the (Hemi)Sphere using
+// SIMD", Clarberg 2008, as in pbrt-v4). Going from a direction to
+// the map takes a few multiplications, a square root and a polynomial
+// instead of acos() and atan(), and every texel covers the same solid
+// angle, so the distribution it is importance sampled with needs no
+// sin(theta) correction.
+//
+// Texels are stored as RGBE (8 bit mantissas and a shared exponent, like
+// the .hdr file format), a third of the size of three floats, and are
+// filtered bilinearly. The sampling distribution is over blocks of texels
+// (at most 512x512 blocks), weighted by the integral of the filtered
+// luminance over each block, so that every direction with light in it can
+// be sampled.
+///////////////////////////////////////////////////////////////////////////
+class EnvironmentMap
+{
+public:
+	// Resample an equirectangular image, with v = 0 looking down (-y) and
+	// u = 0 toward +x, into a map with about as many texels
+	void build(const HDRImage& equirect);
+
+	bool empty() const
+	{
+		return texels.empty();
+	}
+
+	// The radiance in direction wi (which must be normalized)
+	glm::vec3 lookup(const glm::vec3& wi) const;
+	// The same, for count directions at once. The mapping to the octahedron
+	// is vectorized over them.
+	void lookup(const glm::vec3* wi, int count, glm::vec3* radiance) const;
+
+	// A direction toward the environment sampled from two uniform numbers,
+	// and its pdf per solid angle
+	glm::vec3 sample(const glm::vec2& u, float& pdf) const;
+	float pdf(const glm::vec3& wi) const;
+
+private:
+	glm::vec3 texel(int x, int y) const;
+	glm::vec3 bilinear(float x, float y) const;
+	// Integral of the bilinearly filtered luminance over the area of a texel
+	float filteredLuminance(int x, int y) const;
+
+	int size = 0; // The map is size x size texels
+	int block_size = 1; // In texels, per side of a distribution cell
+	std::vector<uint32_t> texels; // RGBE, r in the low byte
+	Distribution2D distribution;
+};
+} // namespace pathtracer
@@ -0,0 +1,309 @@
+#include "LightSampler.h"
+#include "Pathtracer.h"
+#include <algorithm>
+#include <cmath>
+#include <cfloat>
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+const char* light_sampler_names[NUM_LIGHT_SAMPLER_TYPES] = { "Power (alias table)", "Light BVH" };
+
+static float luminance(const vec3& color)
+{
+	return dot(color, vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
+// A point light shines in all directions, a disc into a hemisphere, and
+// every point of a triangle into two hemispheres
+static float lightPower(const Light& l)
+{
+	switch(l.type)
+	{
+	case DISC_LIGHT: return M_PI * luminance(l.intensity);
+	case TRIANGLE_LIGHT: return M_PI * length(cross(l.edges[0], l.edges[1])) * luminance(l.intensity);
+	default: return 4.0f * M_PI * luminance(l.intensity);
+	}
+}
+
+static float safeSqrt(float x)
+{
+	return std::sqrt(std::max(0.0f, x));
+}
+
+///////////////////////////////////////////////////////////////////////////
+// cos(max(0, a - b)) and sin(max(0, a - b)) of angles given as their sines
+// and cosines
+///////////////////////////////////////////////////////////////////////////
+static float cosSubClamped(float sin_a, float cos_a, float sin_b, float cos_b)
+{
+	return cos_a > cos_b ? 1.0f : cos_a * cos_b + sin_a * sin_b;
+}
+
+static float sinSubClamped(float sin_a, float cos_a, float sin_b, float cos_b)
+{
+	return cos_a > cos_b ? 0.0f : sin_a * cos_b - cos_a * sin_b;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// The smallest cone (axis, cos_theta) that holds two others
+///////////////////////////////////////////////////////////////////////////
+static void mergeCones(vec3& axis, float& cos_theta, const vec3& other_axis, float other_cos_theta)
+{
+	const float theta_a = acos(std::max(-1.0f, std::min(1.0f, cos_theta)));
+	const float theta_b = acos(std::max(-1.0f, std::min(1.0f, other_cos_theta)));
+	const float theta_d = acos(std::max(-1.0f, std::min(1.0f, dot(axis, other_axis))));
+	if(std::min(theta_d + theta_b, M_PI) <= theta_a)
+	{
+		return;
+	}
+	if(std::min(theta_d + theta_a, M_PI) <= theta_b)
+	{
+		axis = other_axis;
+		cos_theta = other_cos_theta;
+		return;
+	}
+	const float theta_o = 0.5f * (theta_a + theta_d + theta_b);
+	const vec3 rotation_axis = cross(axis, other_axis);
+	if(theta_o >= M_PI || dot(rotation_axis, rotation_axis) == 0.0f)
+	{
+		cos_theta = -1.0f;
+		return;
+	}
+	// Turn the axis toward the other one, about an axis perpendicular to it
+	const float theta_r = theta_o - theta_a;
+	const vec3 k = normalize(rotation_axis);
+	axis = normalize(axis * std::cos(theta_r) + cross(k, axis) * std::sin(theta_r));
+	cos_theta = std::cos(theta_o);
+}
+
+static vec3 lightCenter(const Light& l)
+{
+	return l.type == TRIANGLE_LIGHT ? l.position + (l.edges[0] + l.edges[1]) / 3.0f : l.position;
+}
+
+bool LightSampler::update(const vector<Light>& new_lights)
+{
+	if(new_lights == lights)
+	{
+		return false;
+	}
+	lights = new_lights;
+	vector<float> powers(lights.size());
+	for(size_t i = 0; i < lights.size(); i++)
+	{
+		powers[i] = lightPower(lights[i]);
+	}
+	nodes.clear();
+	trails.resize(lights.size());
+	if(lights.empty())
+	{
+		return true;
+	}
+	power_distribution.build(powers.data(), int(powers.size()));
+	vector<int> indices(lights.size());
+	for(size_t i = 0; i < lights.size(); i++)
+	{
+		indices[i] = int(i);
+	}
+	nodes.reserve(2 * lights.size());
+	build(indices, 0, int(indices.size()), 0, 0);
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Split the lights in half along the longest axis of their positions
+///////////////////////////////////////////////////////////////////////////
+int LightSampler::build(vector<int>& indices, int begin, int end, uint64_t trail, int depth)
+{
+	const int node_index = int(nodes.size());
+	nodes.push_back(Node());
+	Node node;
+	node.bounds_min = vec3(FLT_MAX);
+	node.bounds_max = vec3(-FLT_MAX);
+	node.power = 0.0f;
+	// Both kinds of lights shine up to 90 degrees away from their directions
+	node.cos_theta_e = 0.0f;
+	vec3 centers_min = vec3(FLT_MAX), centers_max = vec3(-FLT_MAX);
+	for(int i = begin; i < end; i++)
+	{
+		const Light& l = lights[indices[i]];
+		if(l.type == TRIANGLE_LIGHT)
+		{
+			node.bounds_min = min(node.bounds_min, min(l.position, l.position + min(l.edges[0], l.edges[1])));
+			node.bounds_max = max(node.bounds_max, max(l.position, l.position + max(l.edges[0], l.edges[1])));
+		}
+		else
+		{
+			// The extent of a disc along each axis is r sin(angle to its normal)
+			const vec3 extent = l.radius * sqrt(max(vec3(1.0f) - l.direction * l.direction, vec3(0.0f)));
+			node.bounds_min = min(node.bounds_min, l.position - extent);
+			node.bounds_max = max(node.bounds_max, l.position + extent);
+		}
+		const vec3 center = lightCenter(l);
+		centers_min = min(centers_min, center);
+		centers_max = max(centers_max, center);
+		node.power += lightPower(l);
+		// Point lights and triangles shine everywhere, every point on a disc
+		// into the hemisphere around its direction
+		const vec3 axis = l.type == DISC_LIGHT ? l.direction : vec3(0.0f, 1.0f, 0.0f);
+		const float cos_theta_o = l.type == DISC_LIGHT ? 1.0f : -1.0f;
+		if(i == begin)
+		{
+			node.axis = axis;
+			node.cos_theta_o = cos_theta_o;
+		}
+		else
+		{
+			mergeCones(node.axis, node.cos_theta_o, axis, cos_theta_o);
+		}
+	}
+
+	if(end - begin == 1)
+	{
+		node.leaf = true;
+		node.index = indices[begin];
+		trails[node.index] = trail;
+		nodes[node_index] = node;
+		return node_index;
+	}
+	const vec3 size = centers_max - centers_min;
+	const int axis = size.x > size.y && size.x > size.z ? 0 : (size.y > size.z ? 1 : 2);
+	const int middle = (begin + end) / 2;
+	std::nth_element(indices.begin() + begin, indices.begin() + middle, indices.begin() + end,
+	                 [&](int a, int b) { return lightCenter(lights[a])[axis] < lightCenter(lights[b])[axis]; });
+	node.leaf = false;
+	build(indices, begin, middle, trail, depth + 1);
+	node.index = build(indices, middle, end, trail | (uint64_t(1) << depth), depth + 1);
+	nodes[node_index] = node;
+	return node_index;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// An upper bound of sorts of the light a node's lights give point p: its
+// power, over the distance squared, times the cosines at the light and at
+// the surface, taking the smallest angles that any light in the node could
+// have
+///////////////////////////////////////////////////////////////////////////
+float LightSampler::importance(const Node& node, const vec3& p, const vec3& n) const
+{
+	const vec3 center = 0.5f * (node.bounds_min + node.bounds_max);
+	const vec3 half_diagonal = 0.5f * (node.bounds_max - node.bounds_min);
+	const float radius_squared = dot(half_diagonal, half_diagonal);
+	// Points very close to (or in) a node are not favoured without bound
+	const float distance_squared = std::max(dot(p - center, p - center), radius_squared);
+	const vec3 wi = p - center == vec3(0.0f) ? vec3(0.0f, 1.0f, 0.0f) : normalize(p - center);
+
+	// The angle the node's bounding sphere covers, seen from p
+	const float cos_theta_b = dot(p - center, p - center) > radius_squared ?
+	                              safeSqrt(1.0f - radius_squared / dot(p - center, p - center)) :
+	                              -1.0f;
+	const float sin_theta_b = safeSqrt(1.0f - cos_theta_b * cos_theta_b);
+
+	// The smallest angle between a direction a light shines in and wi
+	const float cos_theta_w = dot(node.axis, wi);
+	const float sin_theta_w = safeSqrt(1.0f - cos_theta_w * cos_theta_w);
+	const float sin_theta_o = safeSqrt(1.0f - node.cos_theta_o * node.cos_theta_o);
+	const float cos_theta_x = cosSubClamped(sin_theta_w, cos_theta_w, sin_theta_o, node.cos_theta_o);
+	const float sin_theta_x = sinSubClamped(sin_theta_w, cos_theta_w, sin_theta_o, node.cos_theta_o);
+	const float cos_theta = cosSubClamped(sin_theta_x, cos_theta_x, sin_theta_b, cos_theta_b);
+	if(cos_theta <= node.cos_theta_e)
+	{
+		return 0.0f;
+	}
+
+	// The smallest angle between the surface normal and a light
+	const float cos_theta_i = std::abs(dot(wi, n));
+	const float sin_theta_i = safeSqrt(1.0f - cos_theta_i * cos_theta_i);
+	const float cos_theta_surface = cosSubClamped(sin_theta_i, cos_theta_i, sin_theta_b, cos_theta_b);
+	return std::max(0.0f, node.power * cos_theta * cos_theta_surface / distance_squared);
+}
+
+float LightSampler::firstChildProbability(int node, const vec3& p, const vec3& n) const
+{
+	const float importance_first = importance(nodes[node + 1], p, n);
+	const float importance_second = importance(nodes[nodes[node].index], p, n);
+	if(importance_first <= 0.0f && importance_second <= 0.0f)
+	{
+		return -1.0f;
+	}
+	return importance_first / (importance_first + importance_second);
+}
+
+int LightSampler::sample(int type, const vec3& p, const vec3& n, float u, float& probability) const
+{
+	if(lights.empty())
+	{
+		return -1;
+	}
+	if(type == POWER_LIGHT_SAMPLER)
+	{
+		const int light = power_distribution.sample(u);
+		probability = power_distribution.probabilityOf(light);
+		return light;
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	// What is left of u after each choice is reused for the next one
+	///////////////////////////////////////////////////////////////////////
+	int node = 0;
+	probability = 1.0f;
+	while(!nodes[node].leaf)
+	{
+		const float p_first = firstChildProbability(node, p, n);
+		if(p_first < 0.0f)
+		{
+			return -1;
+		}
+		if(u < p_first)
+		{
+			node = node + 1;
+			u = std::min(u / p_first, 0.99999994f);
+			probability *= p_first;
+		}
+		else
+		{
+			node = nodes[node].index;
+			u = std::min((u - p_first) / (1.0f - p_first), 0.99999994f);
+			probability *= 1.0f - p_first;
+		}
+	}
+	return nodes[node].index;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// The choices sample() makes on the way to the light, from its trail
+///////////////////////////////////////////////////////////////////////////
+float LightSampler::probability(int type, const vec3& p, const vec3& n, int light) const
+{
+	if(type == POWER_LIGHT_SAMPLER)
+	{
+		return power_distribution.probabilityOf(light);
+	}
+	uint64_t trail = trails[light];
+	int node = 0;
+	float probability = 1.0f;
+	while(!nodes[node].leaf)
+	{
+		const float p_first = firstChildProbability(node, p, n);
+		if(p_first < 0.0f)
+		{
+			return 0.0f;
+		}
+		if(trail & 1)
+		{
+			node = nodes[node].index;
+			probability *= 1.0f - p_first;
+		}
+		else
+		{
+			node = node + 1;
+			probability *= p_first;
+		}
+		trail >>= 1;
+	}
+	return probability;
+}
+} // namespace pathtracer
@@ -0,0 +1,109 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+#include <cstdint>
+#include "Distribution.h"
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// A light for direct lighting: a point light, a disc that shines out of its
+// front side (direction), or an emissive triangle, which shines out of both
+// sides. The intensity is the radiant intensity of a point light, or that
+// of a disc along its direction, which makes a disc look like a point light
+// from far away. For a triangle it is its radiance, on average over it.
+///////////////////////////////////////////////////////////////////////////
+enum LightType
+{
+	POINT_LIGHT,
+	DISC_LIGHT,
+	TRIANGLE_LIGHT
+};
+
+struct Light
+{
+	int type;
+	glm::vec3 position; // The first corner of a triangle
+	glm::vec3 direction; // The normal of a disc or triangle
+	float radius;
+	// From the first corner of a triangle to the other two
+	glm::vec3 edges[2];
+	glm::vec3 intensity;
+
+	bool operator==(const Light& l) const
+	{
+		return type == l.type && position == l.position && direction == l.direction && radius == l.radius
+		       && edges[0] == l.edges[0] && edges[1] == l.edges[1] && intensity == l.intensity;
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Picks one light to sample direct lighting from, out of any number of
+// them, with a known probability:
+//   POWER_LIGHT_SAMPLER - in proportion to the lights' power, from an alias
+//                         table in O(1). Ignores where the light is.
+//   BVH_LIGHT_SAMPLER   - by walking down a BVH over the lights, choosing a
+//                         child in proportion to an estimate of how much
+//                         light it can give the shading point. The nodes
+//                         bound the lights' positions and, with a cone, the
+//                         directions they shine in, so lights that are far
+//                         away or facing away count little. O(log N) per
+//                         sample ("Importance Sampling of Many Lights with
+//                         Adaptive Tree Splitting", Conty Estevez & Kulla
+//                         2018, as in pbrt-v4).
+///////////////////////////////////////////////////////////////////////////
+enum LightSamplerType
+{
+	POWER_LIGHT_SAMPLER,
+	BVH_LIGHT_SAMPLER,
+	NUM_LIGHT_SAMPLER_TYPES
+};
+extern const char* light_sampler_names[NUM_LIGHT_SAMPLER_TYPES];
+
+class LightSampler
+{
+public:
+	// Build for these lights, unless they are the same as last time.
+	// Returns true if it was rebuilt.
+	bool update(const std::vector<Light>& lights);
+
+	const std::vector<Light>& getLights() const
+	{
+		return lights;
+	}
+
+	// The light picked with u in [0, 1) to shade point p with normal n, and
+	// the probability it was picked with. -1 if no light can reach p.
+	int sample(int type, const glm::vec3& p, const glm::vec3& n, float u, float& probability) const;
+	// The probability that sample() picks a light, for MIS
+	float probability(int type, const glm::vec3& p, const glm::vec3& n, int light) const;
+
+private:
+	struct Node
+	{
+		glm::vec3 bounds_min, bounds_max;
+		// Every light of the node shines within cos_theta_e of a direction
+		// that is within cos_theta_o of the axis
+		glm::vec3 axis;
+		float cos_theta_o, cos_theta_e;
+		float power;
+		bool leaf;
+		// The light of a leaf, or the second child (the first child is the
+		// next node)
+		int index;
+	};
+
+	int build(std::vector<int>& indices, int begin, int end, uint64_t trail, int depth);
+	float importance(const Node& node, const glm::vec3& p, const glm::vec3& n) const;
+	// The probability of going from a node to its first child, or -1 if no
+	// light of the node can reach p
+	float firstChildProbability(int node, const glm::vec3& p, const glm::vec3& n) const;
+
+	std::vector<Light> lights;
+	Distribution1D power_distribution;
+	std::vector<Node> nodes;
+	// The way down the BVH to each light's leaf, one bit per level, set
+	// where it goes to the second child
+	std::vector<uint64_t> trails;
+};
+} // namespace pathtracer
@@ -2,11 +2,20 @@
 #include <memory>
 #include <iostream>
 #include <map>
+#include <unordered_map>
 #include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <omp.h>
 #include "material.h"
 #include "embree.h"
 #include "sampling.h"
+#include "TileScheduler.h"
+#include "Camera.h"
+#include "Denoiser.h"
+#include "LightSampler.h"
 #include "labhelper.h"
+#include <stb_image_write.h>
 
 using namespace std;
 using namespace glm;
@@ -20,8 +29,128 @@ namespace pathtracer
 Settings settings;
 Environment environment;
 Image rendered_image;
+AOVs aovs;
+Reservoirs reservoirs;
+const char* aov_names[NUM_AOV_TYPES] = { "albedo", "normal", "depth", "object_id", "material_id", "bounces", "time" };
+Statistics statistics;
 PointLight point_light;
 std::vector<DiscLight> disc_lights;
+TileScheduler tile_scheduler;
+Denoiser denoiser;
+LightSampler light_sampler;
+
+///////////////////////////////////////////////////////////////////////////
+// The emissive triangles of the scene. They follow the point and disc
+// lights in the light sampler, in the same order, and a path that hits one
+// finds its light by the ids embree reports for the hit.
+///////////////////////////////////////////////////////////////////////////
+struct TriangleKey
+{
+	uint32_t inst_ID, geom_ID, prim_ID;
+	bool operator==(const TriangleKey& k) const
+	{
+		return inst_ID == k.inst_ID && geom_ID == k.geom_ID && prim_ID == k.prim_ID;
+	}
+};
+
+struct TriangleKeyHash
+{
+	size_t operator()(const TriangleKey& k) const
+	{
+		return size_t(pcgHash(k.inst_ID ^ pcgHash(k.geom_ID ^ pcgHash(k.prim_ID))));
+	}
+};
+
+struct EmissiveLights
+{
+	std::vector<EmissiveTriangle> triangles;
+	int first_light = 0;
+	std::unordered_map<TriangleKey, int, TriangleKeyHash> lights;
+};
+EmissiveLights emissive_lights;
+
+///////////////////////////////////////////////////////////////////////////
+// The first hit of every pixel's primary ray. Primary rays are the same in
+// every pass until the camera or the scene changes (which restarts
+// rendering), so after the first pass they need not be traced again.
+///////////////////////////////////////////////////////////////////////////
+struct PrimaryHit
+{
+	Intersection hit;
+	bool escaped;
+	vec3 environment; // Lenvironment() of the ray, if it escaped
+};
+
+struct PrimaryHitCache
+{
+	bool valid = false;
+	// The camera and environment multiplier the hits were cached with
+	mat4 V, P;
+	float environment_multiplier;
+	std::vector<PrimaryHit> pixels;
+};
+PrimaryHitCache primary_hit_cache;
+
+///////////////////////////////////////////////////////////////////////////
+// Temporal reprojection. When the camera moves, the image becomes the
+// history, and in the first pass with the new camera every pixel starts
+// out from the history pixels its primary hit projects to. History pixels
+// are only used if their depth and normal say that they saw the same
+// surface, so pixels that were hidden before (disoccluded) start over.
+///////////////////////////////////////////////////////////////////////////
+struct ReprojectionHistory
+{
+	bool active = false; // The pass being traced reprojects
+	bool pending = false; // Nothing has been traced since the history was made
+	mat4 PV; // The camera of the history
+	// The camera the image is rendered with, for when it becomes the
+	// history outside of tracePaths()
+	mat4 image_V, image_P;
+	vec3 origin, forward;
+	int width, height;
+	std::vector<vec3> color;
+	std::vector<float> sample_counts;
+	std::vector<float> luminance_squares;
+	AOVs aovs;
+};
+ReprojectionHistory history;
+// Relative difference in depth and cosine of the angle between normals
+// at which a history pixel is taken to show another surface
+const float REPROJECTION_DEPTH_TOLERANCE = 0.05f;
+const float REPROJECTION_NORMAL_TOLERANCE = 0.9f;
+
+///////////////////////////////////////////////////////////////////////////
+// Adaptive sampling. Every time a tile has been sampled, the relative
+// error of its pixels is estimated from their variance. Tiles below
+// settings.adaptive_threshold are converged: later passes skip them and
+// spend all their time on the noisy tiles.
+///////////////////////////////////////////////////////////////////////////
+struct AdaptiveSampling
+{
+	int tiles_x = 0, tiles_y = 0, tile_size = 0;
+	std::vector<float> tile_errors; // After the last sample of each tile
+	std::vector<uint8_t> converged;
+	std::atomic<int> num_converged{ 0 };
+	uint64_t samples = 0; // Taken since the restart
+};
+AdaptiveSampling adaptive;
+// Fewer samples than this say too little about the variance
+const float ADAPTIVE_MIN_SAMPLES = 16.0f;
+
+static void resetAdaptiveSampling()
+{
+	adaptive.tile_errors.assign(adaptive.tile_errors.size(), 1.0f);
+	adaptive.converged.assign(adaptive.converged.size(), 0);
+	adaptive.num_converged = 0;
+	adaptive.samples = 0;
+}
+
+static void resetStatisticsAOVs()
+{
+	aovs.bounces.assign(rendered_image.data.size(), 0.0f);
+	aovs.time.assign(rendered_image.data.size(), 0.0f);
+	aovs.statistics_samples.assign(rendered_image.data.size(), 0.0f);
+}
 
 ///////////////////////////////////////////////////////////////////////////
 // Restart rendering of image
@@ -30,6 +159,19 @@ void restart()
 {
 	// No need to clear image,
 	rendered_image.number_of_samples = 0;
+	std::fill(rendered_image.sample_counts.begin(), rendered_image.sample_counts.end(), 0.0f);
+	primary_hit_cache.valid = false;
+	history.active = false;
+	reservoirs.pixels.clear();
+	resetAdaptiveSampling();
+	resetStatisticsAOVs();
+	// The rest of the pass being rendered would be thrown away
+	tile_scheduler.abortPass();
+}
+
+void interruptTracing(bool interrupt)
+{
+	tile_scheduler.setInterrupted(interrupt);
 }
 
 int getSampleCount()
@@ -37,16 +179,43 @@ int getSampleCount()
 	return std::max(rendered_image.number_of_samples - 1, 0);
 }
 
+static void startReprojection(const mat4& V, const mat4& P);
+
 ///////////////////////////////////////////////////////////////////////////
 // On window resize, window size is passed in, actual size of pathtraced
 // image may be smaller (if we're subsampling for speed)
 ///////////////////////////////////////////////////////////////////////////
 void resize(int w, int h)
 {
+	///////////////////////////////////////////////////////////////////////
+	// With reprojection the image becomes the history, which is reprojected
+	// from its own size, so a change of resolution does not throw it away
+	///////////////////////////////////////////////////////////////////////
+	const bool reproject =
+	    settings.temporal_reprojection && (rendered_image.number_of_samples > 0 || history.active);
+	if(reproject)
+	{
+		tile_scheduler.abortPass();
+		startReprojection(history.image_V, history.image_P);
+	}
 	rendered_image.width = w / settings.subsampling;
 	rendered_image.height = h / settings.subsampling;
 	rendered_image.data.resize(rendered_image.width * rendered_image.height);
-	restart();
+	rendered_image.sample_counts.resize(rendered_image.width * rendered_image.height);
+	rendered_image.luminance_squares.resize(rendered_image.width * rendered_image.height);
+	aovs.depth.resize(rendered_image.width * rendered_image.height);
+	aovs.normal.resize(rendered_image.width * rendered_image.height);
+	aovs.albedo.resize(rendered_image.width * rendered_image.height);
+	aovs.object_id.resize(rendered_image.width * rendered_image.height);
+	aovs.material_id.resize(rendered_image.width * rendered_image.height);
+	if(reproject)
+	{
+		resetStatisticsAOVs();
+	}
+	else
+	{
+		restart();
+	}
 }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -55,108 +224,1502 @@ void resize(int w, int h)
 ///////////////////////////////////////////////////////////////////////////
 vec3 Lenvironment(const vec3& wi)
 {
-	const float theta = acos(std::max(-1.0f, std::min(1.0f, wi.y)));
-	float phi = atan(wi.z, wi.x);
-	if(phi < 0.0f)
-		phi = phi + 2.0f * M_PI;
-	vec2 lookup = vec2(phi / (2.0 * M_PI), 1 - theta / M_PI);
-	return environment.multiplier * environment.map.sample(lookup.x, lookup.y);
+	return environment.multiplier * environment.map.lookup(wi);
+}
+
+///////////////////////////////////////////////////////////////////////////
+/// The equirectangular image is only needed until it is resampled
+///////////////////////////////////////////////////////////////////////////
+void loadEnvironment(const std::string& filename)
+{
+	HDRImage equirect;
+	equirect.load(filename);
+	environment.map.build(equirect);
+}
+
+static bool isEnvironmentSampled()
+{
+	return settings.environment_sampling && !environment.map.empty() && environment.multiplier > 0.0f;
+}
+
+static float luminance(const vec3& color)
+{
+	return dot(color, vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
+///////////////////////////////////////////////////////////////////////////
+/// Multiple importance sampling: light that can be found both by sampling
+/// the light (the environment or an emissive triangle) and by sampling the
+/// bsdf is weighted by the power heuristic ("Optimally Combining Sampling
+/// Techniques for Monte Carlo Rendering", Veach & Guibas 1995), so that
+/// each technique counts where it has the lower variance.
+///////////////////////////////////////////////////////////////////////////
+static float powerHeuristic(float pdf, float other_pdf)
+{
+	const float a = pdf * pdf, b = other_pdf * other_pdf;
+	return a + b > 0.0f ? a / (a + b) : 0.0f;
 }
 
 ///////////////////////////////////////////////////////////////////////////
-/// Calculate the radiance going from one point (r.hitPosition()) in one
-/// direction (-r.d), through path tracing.
+/// The weight of the environment seen by a path that escaped in direction
+/// wi, after its last bounce was sampled with bounce_pdf (0 if it was a
+/// perfect mirror or refraction, which the light sampling can not find)
 ///////////////////////////////////////////////////////////////////////////
-vec3 Li(Ray& primary_ray)
+static float escapedEnvironmentWeight(const vec3& wi, float bounce_pdf)
+{
+	if(!isEnvironmentSampled() || bounce_pdf <= 0.0f)
+	{
+		return 1.0f;
+	}
+	return powerHeuristic(bounce_pdf, environment.map.pdf(wi));
+}
+
+///////////////////////////////////////////////////////////////////////////
+/// A ray leaving the surface at a hit point in direction wi. The origin is
+/// moved off the surface, to the side wi leaves on, so that the ray does
+/// not hit the triangle it starts on.
+///////////////////////////////////////////////////////////////////////////
+static Ray spawnRay(const Intersection& hit, const vec3& wi, float far = FLT_MAX)
+{
+	const vec3 offset = (dot(wi, hit.geometry_normal) > 0.0f ? EPSILON : -EPSILON) * hit.geometry_normal;
+	return Ray(hit.position + offset, wi, 0.0f, far);
+}
+
+///////////////////////////////////////////////////////////////////////////
+/// The radiance a material emits at a point with texture coordinates uv.
+/// An emission texture replaces the emission color, as in the labs.
+///////////////////////////////////////////////////////////////////////////
+static vec3 emittedRadiance(const labhelper::Material& material, const vec2& uv)
+{
+	if(material.m_emission_texture.valid)
+	{
+		return vec3(material.m_emission_texture.sample(fract(uv)));
+	}
+	return material.m_emission;
+}
+
+///////////////////////////////////////////////////////////////////////////
+/// The radiance of a triangle on average, from the centers of the 16 equal
+/// triangles it splits into. It only weights how often the triangle is
+/// sampled, so it need not be exact.
+///////////////////////////////////////////////////////////////////////////
+static vec3 averageEmission(const EmissiveTriangle& t)
+{
+	if(!t.material->m_emission_texture.valid)
+	{
+		return t.material->m_emission;
+	}
+	const int n = 4;
+	vec3 sum = vec3(0.0f);
+	for(int i = 0; i < n; i++)
+	{
+		for(int j = 0; i + j < n; j++)
+		{
+			// The triangle pointing up at (i, j), and the one pointing down
+			// next to it, if there is one
+			for(float offset : { 1.0f / 3.0f, 2.0f / 3.0f })
+			{
+				if(offset > 0.5f && i + j == n - 1)
+				{
+					continue;
+				}
+				const float b1 = (float(i) + offset) / float(n), b2 = (float(j) + offset) / float(n);
+				const vec2 uv = (1.0f - b1 - b2) * t.uvs[0] + b1 * t.uvs[1] + b2 * t.uvs[2];
+				sum += emittedRadiance(*t.material, uv);
+			}
+		}
+	}
+	return sum / float(n * n);
+}
+
+///////////////////////////////////////////////////////////////////////////
+/// Give the light sampler the point light, the disc lights and the
+/// emissive triangles. Rebuilding it is only needed when they changed.
+///////////////////////////////////////////////////////////////////////////
+static bool updateLights()
+{
+	vector<Light> lights;
+	lights.push_back({ POINT_LIGHT, point_light.position, vec3(0.0f), 0.0f, { vec3(0.0f), vec3(0.0f) },
+	                   point_light.intensity_multiplier * point_light.color });
+	for(const DiscLight& l : disc_lights)
+	{
+		lights.push_back({ DISC_LIGHT, l.position, normalize(l.direction), l.radius, { vec3(0.0f), vec3(0.0f) },
+		                   l.intensity_multiplier * l.color });
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	// Triangles without area can not be hit, nor sampled
+	///////////////////////////////////////////////////////////////////////
+	vector<EmissiveTriangle>& triangles = emissive_lights.triangles;
+	triangles.clear();
+	if(settings.emissive_lights)
+	{
+		getEmissiveTriangles(triangles);
+	}
+	emissive_lights.first_light = int(lights.size());
+	emissive_lights.lights.clear();
+	size_t count = 0;
+	for(const EmissiveTriangle& t : triangles)
+	{
+		const vec3 edge0 = t.positions[1] - t.positions[0], edge1 = t.positions[2] - t.positions[0];
+		const vec3 normal = cross(edge0, edge1);
+		if(dot(normal, normal) == 0.0f)
+		{
+			continue;
+		}
+		emissive_lights.lights[{ t.inst_ID, t.geom_ID, t.prim_ID }] = int(lights.size());
+		lights.push_back({ TRIANGLE_LIGHT, t.positions[0], normalize(normal), 0.0f, { edge0, edge1 },
+		                   averageEmission(t) });
+		triangles[count++] = t;
+	}
+	triangles.resize(count);
+	return light_sampler.update(lights);
+}
+
+///////////////////////////////////////////////////////////////////////////
+/// The pdf per solid angle of sampling direction wi toward a point at
+/// distance d on a triangle light, which was picked with probability.
+/// Points on a triangle are uniform, with pdf 1 / area.
+///////////////////////////////////////////////////////////////////////////
+static float triangleLightPdf(const Light& light, float probability, const vec3& wi, float d)
+{
+	const float light_cosine = std::abs(dot(wi, light.direction));
+	const float area = 0.5f * length(cross(light.edges[0], light.edges[1]));
+	return light_cosine > 0.0f ? probability * d * d / (light_cosine * area) : 0.0f;
+}
+
+///////////////////////////////////////////////////////////////////////////
+/// The MIS weight of the light emitted by a hit that the ray of a bounce
+/// found, against finding it with light sampling from the bounce's position
+/// and normal. A perfect mirror or refraction (bounce_pdf 0) can not be
+/// found by light sampling, nor can a triangle that is not a light. If the
+/// direct lighting at the bounce was resampled (by ReSTIR), that counts all
+/// of the light that light sampling can find.
+///////////////////////////////////////////////////////////////////////////
+static float emissionWeight(const Ray& ray, const Intersection& hit, const vec3& bounce_position,
+                            const vec3& bounce_normal, float bounce_pdf, bool resampled)
+{
+	if(bounce_pdf <= 0.0f)
+	{
+		return 1.0f;
+	}
+	auto it = emissive_lights.lights.find({ ray.instID, ray.geomID, ray.primID });
+	if(it == emissive_lights.lights.end())
+	{
+		return 1.0f;
+	}
+	const float probability =
+	    light_sampler.probability(settings.light_sampler, bounce_position, bounce_normal, it->second);
+	const float d = length(hit.position - bounce_position);
+	const float light_pdf =
+	    triangleLightPdf(light_sampler.getLights()[it->second], probability, (hit.position - bounce_position) / d, d);
+	if(resampled)
+	{
+		return light_pdf > 0.0f ? 0.0f : 1.0f;
+	}
+	return powerHeuristic(bounce_pdf, float(settings.light_samples) * light_pdf);
+}
+
+///////////////////////////////////////////////////////////////////////////
+/// A point on a light, seen from a hit point
+///////////////////////////////////////////////////////////////////////////
+struct LightPoint
+{
+	vec3 wi;
+	float distance;
+	// The bsdf times the cosine times the light that arrives, assuming it
+	// is not occluded, per unit of the numbers that picked the point
+	vec3 contribution;
+};
+
+///////////////////////////////////////////////////////////////////////////
+/// The point that u, uniform in [0, 1)^2, picks on a light: uniform on a
+/// disc or a triangle. Its contribution is the integrand of the direct
+/// lighting over u, so sampling u uniformly leaves dividing by the
+/// probability of the light. Returns false if the point gives no light.
+///////////////////////////////////////////////////////////////////////////
+static bool evaluateLightPoint(const Intersection& hit, const BTDF& mat, int index, const vec2& u,
+                               LightPoint& point)
+{
+	const Light& light = light_sampler.getLights()[index];
+	vec3 position = light.position;
+	vec3 barycentrics = vec3(0.0f);
+	if(light.type == DISC_LIGHT)
+	{
+		position += tangentSpace(light.direction) * vec3(light.radius * concentricSampleDisk(u), 0.0f);
+	}
+	else if(light.type == TRIANGLE_LIGHT)
+	{
+		barycentrics = uniformSampleTriangle(u);
+		position += barycentrics.y * light.edges[0] + barycentrics.z * light.edges[1];
+	}
+	point.distance = length(position - hit.position);
+	point.wi = (position - hit.position) / point.distance;
+	const float cosine_term = dot(point.wi, hit.shading_normal);
+	if(!(cosine_term > 0.0f))
+	{
+		return false;
+	}
+	vec3 Li;
+	if(light.type == TRIANGLE_LIGHT)
+	{
+		// The radiance, over the pdf per solid angle of a uniform point
+		const EmissiveTriangle& t = emissive_lights.triangles[index - emissive_lights.first_light];
+		const vec2 uv = barycentrics.x * t.uvs[0] + barycentrics.y * t.uvs[1] + barycentrics.z * t.uvs[2];
+		const float light_pdf = triangleLightPdf(light, 1.0f, point.wi, point.distance);
+		if(light_pdf <= 0.0f)
+		{
+			return false;
+		}
+		Li = emittedRadiance(*t.material, uv) / light_pdf;
+	}
+	else
+	{
+		// The radiance of a disc, intensity / area, and the pdf of the
+		// point, 1 / area, cancel out, which leaves the cosine at the light
+		const float light_cosine = light.type == DISC_LIGHT ? dot(-point.wi, light.direction) : 1.0f;
+		if(light_cosine <= 0.0f)
+		{
+			return false;
+		}
+		Li = light.intensity * (light_cosine / (point.distance * point.distance));
+	}
+	point.contribution = mat.f(point.wi, hit.wo, hit.shading_normal) * Li * cosine_term;
+	return point.contribution != vec3(0.0f);
+}
+
+///////////////////////////////////////////////////////////////////////////
+/// The shadow ray toward a light point. It stops short of the light, which
+/// may be a triangle of the scene.
+///////////////////////////////////////////////////////////////////////////
+static Ray shadowRay(const Intersection& hit, const LightPoint& point)
+{
+	return spawnRay(hit, point.wi, point.distance * (1.0f - EPSILON));
+}
+
+///////////////////////////////////////////////////////////////////////////
+/// Direct illumination at a hit point from a light picked by the light
+/// sampler, divided by the probability it was picked with, assuming that
+/// the light is visible. The shadow ray that tests that is returned in
+/// shadow_ray. At the last vertex of a path no bounce can hit an emissive
+/// triangle, so its samples are not MIS weighted.
+///////////////////////////////////////////////////////////////////////////
+static vec3 sampleDirectLight(const Intersection& hit, const BTDF& mat, bool last_vertex, Ray& shadow_ray)
+{
+	// As many random numbers are taken whatever light is picked, so that
+	// the rest of the path gets the same dimensions
+	const float u = randf();
+	const vec2 u_point = randf2();
+	float probability;
+	const int index =
+	    light_sampler.sample(settings.light_sampler, hit.position, hit.shading_normal, u, probability);
+	LightPoint point;
+	if(index < 0 || probability <= 0.0f || !evaluateLightPoint(hit, mat, index, u_point, point))
+	{
+		return vec3(0.0f);
+	}
+	///////////////////////////////////////////////////////////////////////
+	// A path can also hit an emissive triangle, so the two ways of finding
+	// it are weighted with MIS
+	///////////////////////////////////////////////////////////////////////
+	const Light& light = light_sampler.getLights()[index];
+	float weight = 1.0f;
+	if(light.type == TRIANGLE_LIGHT && !last_vertex)
+	{
+		const float light_pdf = triangleLightPdf(light, probability, point.wi, point.distance);
+		weight = powerHeuristic(float(settings.light_samples) * light_pdf,
+		                        mat.pdf(point.wi, hit.wo, hit.shading_normal));
+	}
+	shadow_ray = shadowRay(hit, point);
+	return point.contribution * (weight / probability);
+}
+
+///////////////////////////////////////////////////////////////////////////
+/// ReSTIR DI ("Spatiotemporal reservoir resampling for real-time ray
+/// tracing with dynamic direct lighting", Bitterli et al. 2020). Out of
+/// many light points, resampled importance sampling picks one in
+/// proportion to the light it gives, ignoring occlusion (the target), and
+/// weights it so that its contribution is right on average. The pick is
+/// streamed through a reservoir, which remembers how many candidates it saw
+/// and can be resampled again together with others.
+///
+/// Each pass a pixel picks out of its new candidates, the reservoir of the
+/// last pass at the pixel its hit was seen at (temporal reuse, reprojected)
+/// and a few reservoirs of the last pass around it (spatial reuse), if they
+/// are of a similar surface. Taking the neighbours from the last pass too
+/// means that pixels need not wait for each other, and tiles are traced as
+/// before. Only the point finally picked is tested with a shadow ray, and
+/// is not passed on if it is occluded. Reusing points whose visibility
+/// differs from pixel to pixel is biased, which suits previews.
+///////////////////////////////////////////////////////////////////////////
+const float RESTIR_SPATIAL_RADIUS = 16.0f; // In pixels
+// The most candidates a reused reservoir counts as, per new candidate, so
+// that the points of old passes are not held on to for ever
+const float RESTIR_MAX_HISTORY = 20.0f;
+// Relative difference in depth at which a reservoir is of another surface.
+// Normals are compared as for reprojection.
+const float RESTIR_DEPTH_TOLERANCE = 0.1f;
+
+///////////////////////////////////////////////////////////////////////////
+/// The reservoirs made so far are those the next pass reuses. Pixels that
+/// are not traced (in converged tiles) keep theirs. There are none after a
+/// restart.
+///////////////////////////////////////////////////////////////////////////
+static void startResampling(const mat4& V, const mat4& P)
+{
+	if(reservoirs.pixels.size() != rendered_image.data.size())
+	{
+		reservoirs.pixels.assign(rendered_image.data.size(), Reservoir());
+	}
+	reservoirs.previous = reservoirs.pixels;
+	reservoirs.previous_PV = reservoirs.PV;
+	reservoirs.PV = P * V;
+	reservoirs.origin = vec3(inverse(V)[3]);
+}
+
+static bool isSimilarSurface(const Reservoir& r, const Intersection& hit)
+{
+	const float depth = length(hit.position - reservoirs.origin);
+	return std::abs(length(r.position - reservoirs.origin) - depth) <= RESTIR_DEPTH_TOLERANCE * depth
+	       && dot(r.normal, hit.shading_normal) >= REPROJECTION_NORMAL_TOLERANCE;
+}
+
+///////////////////////////////////////////////////////////////////////////
+/// Whether a light point could light the surface a reservoir was made for,
+/// occlusion aside. Only then could that reservoir have picked the point.
+///////////////////////////////////////////////////////////////////////////
+static bool canReach(int index, const vec2& u, const Reservoir& r)
+{
+	Intersection surface;
+	surface.position = r.position;
+	surface.shading_normal = r.normal;
+	surface.wo = r.normal;
+	const Diffuse white(vec3(1.0f));
+	LightPoint point;
+	return evaluateLightPoint(surface, white, index, u, point);
+}
+
+///////////////////////////////////////////////////////////////////////////
+/// Direct illumination at the primary hit of pixel (x, y), from the light
+/// point that ReSTIR picks, assuming that it is visible. The pixel's
+/// reservoir is updated. The shadow ray that tests the point is returned in
+/// shadow_ray, and if it is occluded, discardReservoir() must be called.
+///////////////////////////////////////////////////////////////////////////
+static vec3 resampleDirectLight(int x, int y, const Intersection& hit, const BTDF& mat, Ray& shadow_ray)
+{
+	const int num_lights = int(light_sampler.getLights().size());
+	Reservoir r;
+	r.position = hit.position;
+	r.normal = hit.shading_normal;
+	float weight_sum = 0.0f;
+	LightPoint picked;
+	float picked_target = 0.0f;
+	auto add = [&](int light, const vec2& u, float weight_per_target, float M, float u_pick) {
+		LightPoint point;
+		const float target =
+		    light >= 0 && evaluateLightPoint(hit, mat, light, u, point) ? luminance(point.contribution) : 0.0f;
+		const float weight = target * weight_per_target;
+		weight_sum += weight;
+		r.M += M;
+		if(weight > 0.0f && u_pick * weight_sum < weight)
+		{
+			r.light = light;
+			r.u = u;
+			picked = point;
+			picked_target = target;
+		}
+	};
+
+	///////////////////////////////////////////////////////////////////////
+	// New candidates, from the light sampler. As many random numbers are
+	// taken whatever happens, so that the rest of the path gets the same
+	// dimensions.
+	///////////////////////////////////////////////////////////////////////
+	for(int i = 0; i < settings.restir_candidates; i++)
+	{
+		const float u_light = randf();
+		const float u_pick = randf();
+		const vec2 u_point = randf2();
+		float probability;
+		const int light =
+		    light_sampler.sample(settings.light_sampler, hit.position, hit.shading_normal, u_light, probability);
+		const bool valid = light >= 0 && probability > 0.0f;
+		add(valid ? light : -1, u_point, valid ? 1.0f / probability : 0.0f, 1.0f, u_pick);
+	}
+	const float new_candidates = r.M;
+
+	///////////////////////////////////////////////////////////////////////
+	// The reservoirs of the last pass where the hit was seen, and around
+	// it. A reservoir stands for its M candidates, each weighted by the
+	// target here times its contribution weight.
+	///////////////////////////////////////////////////////////////////////
+	Reservoir reused[1 + RESTIR_MAX_SPATIAL_SAMPLES];
+	int num_reused = 0;
+	const vec4 clip = reservoirs.previous_PV * vec4(hit.position, 1.0f);
+	const int num_spatial = std::min(std::max(settings.restir_spatial_samples, 0), RESTIR_MAX_SPATIAL_SAMPLES);
+	for(int i = 0; i <= num_spatial; i++)
+	{
+		const vec2 offset = i > 0 ? RESTIR_SPATIAL_RADIUS * concentricSampleDisk() : vec2(0.0f);
+		const float u_pick = randf();
+		if(clip.w <= 0.0f)
+		{
+			continue;
+		}
+		const int px = int(floor((0.5f * clip.x / clip.w + 0.5f) * float(rendered_image.width) + offset.x));
+		const int py = int(floor((0.5f * clip.y / clip.w + 0.5f) * float(rendered_image.height) + offset.y));
+		if(px < 0 || py < 0 || px >= rendered_image.width || py >= rendered_image.height)
+		{
+			continue;
+		}
+		Reservoir q = reservoirs.previous[py * rendered_image.width + px];
+		if(q.M <= 0.0f || !isSimilarSurface(q, hit))
+		{
+			continue;
+		}
+		q.M = std::min(q.M, RESTIR_MAX_HISTORY * float(settings.restir_candidates));
+		add(q.light < num_lights ? q.light : -1, q.u, q.W * q.M, q.M, u_pick);
+		reused[num_reused++] = q;
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	// The weight sum is divided by the candidates that could have been the
+	// point picked, which are not all of them where the surfaces differ
+	///////////////////////////////////////////////////////////////////////
+	Reservoir& pixel = reservoirs.pixels[y * rendered_image.width + x];
+	if(picked_target <= 0.0f)
+	{
+		r.light = -1;
+		pixel = r;
+		return vec3(0.0f);
+	}
+	float Z = new_candidates;
+	for(int i = 0; i < num_reused; i++)
+	{
+		if(canReach(r.light, r.u, reused[i]))
+		{
+			Z += reused[i].M;
+		}
+	}
+	r.W = weight_sum / (Z * picked_target);
+	pixel = r;
+	shadow_ray = shadowRay(hit, picked);
+	return picked.contribution * r.W;
+}
+
+///////////////////////////////////////////////////////////////////////////
+/// The point the reservoir of a pixel (its index in the image) picked is
+/// occluded, so it is not reused
+///////////////////////////////////////////////////////////////////////////
+static void discardReservoir(int pixel)
+{
+	reservoirs.pixels[pixel].W = 0.0f;
+}
+
+///////////////////////////////////////////////////////////////////////////
+/// Direct illumination from the environment at a hit point, in a direction
+/// sampled from the environment map, assuming that it is not occluded. The
+/// shadow ray that tests that is returned in shadow_ray. At the last vertex
+/// of a path no bounce finds the environment, so it is not MIS weighted.
+///////////////////////////////////////////////////////////////////////////
+static vec3 sampleEnvironmentLight(const Intersection& hit, const BTDF& mat, bool last_vertex, Ray& shadow_ray)
+{
+	const vec2 u = randf2();
+	float pdf;
+	const vec3 wi = environment.map.sample(u, pdf);
+	const float cosine_term = dot(wi, hit.shading_normal);
+	if(pdf <= 0.0f || cosine_term <= 0.0f)
+	{
+		return vec3(0.0f);
+	}
+	const vec3 f = mat.f(wi, hit.wo, hit.shading_normal);
+	if(f == vec3(0.0f))
+	{
+		return vec3(0.0f);
+	}
+	shadow_ray = spawnRay(hit, wi);
+	const float weight = last_vertex ? 1.0f : powerHeuristic(pdf, mat.pdf(wi, hit.wo, hit.shading_normal));
+	return f * Lenvironment(wi) * (weight * cosine_term / pdf);
+}
+
+///////////////////////////////////////////////////////////////////////////
+/// Sample the direction a path continues in and update its throughput.
+/// Returns false if the path ends here. The pdf that MIS weights the
+/// direction with is returned in bounce_pdf.
+///////////////////////////////////////////////////////////////////////////
+static bool sampleBounce(const Intersection& hit, const BTDF& mat, vec3& path_throughput, Ray& next_ray,
+                         float& bounce_pdf)
+{
+	WiSample r = mat.sample_wi(hit.wo, hit.shading_normal);
+	if(r.pdf < EPSILON)
+	{
+		return false;
+	}
+	const float cosine_term = abs(dot(r.wi, hit.shading_normal));
+	path_throughput = path_throughput * (r.f * cosine_term) / r.pdf;
+	if(path_throughput == vec3(0.0f))
+	{
+		return false;
+	}
+	next_ray = spawnRay(hit, r.wi);
+	bounce_pdf = mat.pdf(r.wi, hit.wo, hit.shading_normal);
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////
+/// Calculate the radiance going from one point (primary_hit.position) in
+/// one direction (primary_hit.wo), through path tracing. The primary hit is
+/// seen at pixel (x, y). The number of rays traced after the primary one is
+/// added to num_bounces, if given.
+///////////////////////////////////////////////////////////////////////////
+vec3 Li(const Intersection& primary_hit, int x, int y, int* num_bounces = nullptr)
 {
 	vec3 L = vec3(0.0f);
 	vec3 path_throughput = vec3(1.0);
-	Ray current_ray = primary_ray;
-
-	///////////////////////////////////////////////////////////////////
-	// Get the intersection information from the ray
-	///////////////////////////////////////////////////////////////////
-	Intersection hit = getIntersection(current_ray);
-	///////////////////////////////////////////////////////////////////
-	// Create a Material tree for evaluating brdfs and calculating
-	// sample directions.
-	///////////////////////////////////////////////////////////////////
-
-	Diffuse diffuse(hit.material->m_color);
-	BTDF& mat = diffuse;
-	///////////////////////////////////////////////////////////////////
-	// Calculate Direct Illumination from light.
-	///////////////////////////////////////////////////////////////////
-	{
-		const float distance_to_light = length(point_light.position - hit.position);
-		const float falloff_factor = 1.0f / (distance_to_light * distance_to_light);
-		vec3 Li = point_light.intensity_multiplier * point_light.color * falloff_factor;
-		vec3 wi = normalize(point_light.position - hit.position);
-		L = mat.f(wi, hit.wo, hit.shading_normal) * Li * std::max(0.0f, dot(wi, hit.shading_normal));
+	Ray current_ray;
+	float bounce_pdf = 0.0f;
+	vec3 bounce_position, bounce_normal;
+	Intersection hit = primary_hit;
+
+	for(int bounces = 0;; bounces++)
+	{
+		///////////////////////////////////////////////////////////////////
+		// Add the light emitted by the hit
+		///////////////////////////////////////////////////////////////////
+		const vec3 emission = emittedRadiance(*hit.material, hit.uv);
+		if(emission != vec3(0.0f))
+		{
+			L += path_throughput * emission
+			     * emissionWeight(current_ray, hit, bounce_position, bounce_normal, bounce_pdf,
+			                      reservoirs.active && bounces == 1);
+		}
+
+		///////////////////////////////////////////////////////////////////
+		// Create a Material tree for evaluating brdfs and calculating
+		// sample directions.
+		///////////////////////////////////////////////////////////////////
+
+		Diffuse diffuse(hit.material->m_color);
+		BTDF& mat = diffuse;
+		///////////////////////////////////////////////////////////////////
+		// Calculate Direct Illumination from light.
+		///////////////////////////////////////////////////////////////////
+		if(reservoirs.active && bounces == 0)
+		{
+			Ray shadow_ray;
+			vec3 Ld = resampleDirectLight(x, y, hit, mat, shadow_ray);
+			if(Ld != vec3(0.0f))
+			{
+				if(occluded(shadow_ray))
+				{
+					discardReservoir(y * rendered_image.width + x);
+				}
+				else
+				{
+					L += path_throughput * Ld;
+				}
+			}
+		}
+		for(int i = 0; i < settings.light_samples && !(reservoirs.active && bounces == 0); i++)
+		{
+			Ray shadow_ray;
+			vec3 Ld = sampleDirectLight(hit, mat, bounces >= settings.max_bounces, shadow_ray);
+			if(Ld != vec3(0.0f) && !occluded(shadow_ray))
+			{
+				L += path_throughput * Ld / float(settings.light_samples);
+			}
+		}
+		if(isEnvironmentSampled())
+		{
+			Ray shadow_ray;
+			vec3 Le = sampleEnvironmentLight(hit, mat, bounces >= settings.max_bounces, shadow_ray);
+			if(Le != vec3(0.0f) && !occluded(shadow_ray))
+			{
+				L += path_throughput * Le;
+			}
+		}
+		///////////////////////////////////////////////////////////////////
+		// Continue the path in a sampled direction, the environment is
+		// what it sees if it escapes the scene.
+		///////////////////////////////////////////////////////////////////
+		if(bounces >= settings.max_bounces || !sampleBounce(hit, mat, path_throughput, current_ray, bounce_pdf))
+		{
+			break;
+		}
+		bounce_position = hit.position;
+		bounce_normal = hit.shading_normal;
+		if(num_bounces)
+		{
+			(*num_bounces)++;
+		}
+		if(!intersect(current_ray))
+		{
+			L += path_throughput * Lenvironment(current_ray.d)
+			     * escapedEnvironmentWeight(current_ray.d, bounce_pdf);
+			break;
+		}
+		///////////////////////////////////////////////////////////////////
+		// Get the intersection information from the ray
+		///////////////////////////////////////////////////////////////////
+		hit = getIntersection(current_ray);
 	}
 	// Return the final outgoing radiance for the primary ray
 	return L;
 }
 
 ///////////////////////////////////////////////////////////////////////////
-/// Used to homogenize points transformed with projection matrices
+/// The block of pixels covered by one ray packet: 2x2, 4x2 or 4x4
 ///////////////////////////////////////////////////////////////////////////
-inline static glm::vec3 homogenize(const glm::vec4& p)
+static void getPacketBlock(int packet_width, int& block_width, int& block_height)
 {
-	return glm::vec3(p * (1.f / p.w));
+	block_width = packet_width >= 8 ? 4 : 2;
+	block_height = packet_width / block_width;
 }
 
 ///////////////////////////////////////////////////////////////////////////
-/// Trace one path per pixel and accumulate the result in an image
+/// Call trace(x, y, ray) for every pixel of the tile, with the primary ray
+/// of that pixel intersected with the scene. With packets, the rays of
+/// each block of pixels are intersected together.
 ///////////////////////////////////////////////////////////////////////////
-void tracePaths(const glm::mat4& V, const glm::mat4& P)
+template<typename F>
+static void traceTile(const Tile& tile, const Camera& camera, bool packets, const F& trace)
 {
-	// Stop here if we have as many samples as we want
-	if((int(rendered_image.number_of_samples) > settings.max_paths_per_pixel)
-	   && (settings.max_paths_per_pixel != 0))
+	const uint32_t sample_index = rendered_image.number_of_samples;
+	Ray rays[16];
+	if(!packets)
 	{
+		for(int y = tile.y0; y < tile.y1; y++)
+		{
+			for(int x0 = tile.x0; x0 < tile.x1; x0 += 16)
+			{
+				const int count = std::min(16, tile.x1 - x0);
+				camera.generateRays(x0, y, count, sample_index, rays);
+				for(int i = 0; i < count; i++)
+				{
+					intersect(rays[i]);
+					trace(x0 + i, y, rays[i]);
+				}
+			}
+		}
 		return;
 	}
-	vec3 camera_pos = vec3(glm::inverse(V) * vec4(0.0f, 0.0f, 0.0f, 1.0f));
-	// Trace one path per pixel (the omp parallel stuf magically distributes the
-	// pathtracing on all cores of your CPU).
-	int num_rays = 0;
-	vector<vec4> local_image(rendered_image.width * rendered_image.height, vec4(0.0f));
-
-#pragma omp parallel for
-	for(int y = 0; y < rendered_image.height; y++)
-	{
-		for(int x = 0; x < rendered_image.width; x++)
-		{
-			vec3 color;
-			Ray primaryRay;
-			primaryRay.o = camera_pos;
-			// Create a ray that starts in the camera position and points toward
-			// the current pixel on a virtual screen.
-			vec2 screenCoord = vec2(float(x) / float(rendered_image.width),
-			                        float(y) / float(rendered_image.height));
-			// Calculate direction
-			vec4 viewCoord = vec4(screenCoord.x * 2.0f - 1.0f, screenCoord.y * 2.0f - 1.0f, 1.0f, 1.0f);
-			vec3 p = homogenize(inverse(P * V) * viewCoord);
-			primaryRay.d = normalize(p - camera_pos);
-			// Intersect ray with scene
-			if(intersect(primaryRay))
-			{
-				// If it hit something, evaluate the radiance from that point
-				color = Li(primaryRay);
+
+	const int packet_width = getPacketWidth();
+	int block_width, block_height;
+	getPacketBlock(packet_width, block_width, block_height);
+	bool valid[16];
+	for(int by = tile.y0; by < tile.y1; by += block_height)
+	{
+		for(int bx = tile.x0; bx < tile.x1; bx += block_width)
+		{
+			const int count = std::min(block_width, tile.x1 - bx);
+			for(int row = 0; row < block_height; row++)
+			{
+				Ray* row_rays = &rays[row * block_width];
+				if(by + row < tile.y1)
+				{
+					camera.generateRays(bx, by + row, count, sample_index, row_rays);
+				}
+				for(int i = 0; i < block_width; i++)
+				{
+					valid[row * block_width + i] = by + row < tile.y1 && i < count;
+					if(!valid[row * block_width + i])
+					{
+						row_rays[i] = Ray();
+					}
+				}
+			}
+			intersectPacket(rays, valid);
+			for(int i = 0; i < packet_width; i++)
+			{
+				if(valid[i])
+				{
+					trace(bx + i % block_width, by + i / block_width, rays[i]);
+				}
+			}
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+/// Add a sample to the running average of a pixel
+///////////////////////////////////////////////////////////////////////////
+static void accumulate(int x, int y, const vec3& color)
+{
+	const int i = y * rendered_image.width + x;
+	float& n = rendered_image.sample_counts[i];
+	const float l = luminance(color);
+	rendered_image.data[i] = rendered_image.data[i] * (n / (n + 1.0f)) + (1.0f / (n + 1.0f)) * color;
+	rendered_image.luminance_squares[i] =
+	    rendered_image.luminance_squares[i] * (n / (n + 1.0f)) + (1.0f / (n + 1.0f)) * l * l;
+	n += 1.0f;
+}
+
+///////////////////////////////////////////////////////////////////////////
+/// Add the bounces and shading time of a sample to the statistics AOVs
+///////////////////////////////////////////////////////////////////////////
+static void accumulateStatistics(int x, int y, int bounces, double time)
+{
+	const int i = y * rendered_image.width + x;
+	aovs.bounces[i] += float(bounces);
+	aovs.time[i] += float(time);
+	aovs.statistics_samples[i] += 1.0f;
+}
+
+///////////////////////////////////////////////////////////////////////////
+/// The relative standard error of the mean luminance of a tile's pixels:
+/// the root mean square of the pixels' standard errors, relative to the
+/// average luminance (plus a little, so that black tiles converge).
+/// min_samples is set to the fewest samples of any pixel.
+///////////////////////////////////////////////////////////////////////////
+static float tileError(const Tile& tile, float& min_samples)
+{
+	double variance_sum = 0.0, luminance_sum = 0.0;
+	min_samples = FLT_MAX;
+	for(int y = tile.y0; y < tile.y1; y++)
+	{
+		for(int x = tile.x0; x < tile.x1; x++)
+		{
+			const int i = y * rendered_image.width + x;
+			const float n = rendered_image.sample_counts[i];
+			const float mean = luminance(rendered_image.data[i]);
+			min_samples = std::min(min_samples, n);
+			if(n > 1.0f)
+			{
+				const float variance =
+				    std::max(0.0f, rendered_image.luminance_squares[i] - mean * mean) * n / (n - 1.0f);
+				variance_sum += variance / n;
+			}
+			luminance_sum += mean;
+		}
+	}
+	const double num_pixels = double((tile.x1 - tile.x0) * (tile.y1 - tile.y0));
+	return float(sqrt(variance_sum / num_pixels) / (luminance_sum / num_pixels + 0.01));
+}
+
+static int adaptiveTileIndex(const Tile& tile)
+{
+	return (tile.y0 / adaptive.tile_size) * adaptive.tiles_x + tile.x0 / adaptive.tile_size;
+}
+
+bool isRenderingDone()
+{
+	if(settings.max_paths_per_pixel != 0 && rendered_image.number_of_samples > settings.max_paths_per_pixel)
+	{
+		return true;
+	}
+	if(settings.adaptive_sampling)
+	{
+		const int num_tiles = adaptive.tiles_x * adaptive.tiles_y;
+		const uint64_t num_pixels = uint64_t(rendered_image.width) * uint64_t(rendered_image.height);
+		if(num_tiles > 0 && adaptive.num_converged == num_tiles)
+		{
+			return true;
+		}
+		if(settings.adaptive_sample_budget > 0.0f
+		   && double(adaptive.samples) >= double(settings.adaptive_sample_budget) * double(num_pixels))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+///////////////////////////////////////////////////////////////////////////
+/// Make the image the history that the next pass reprojects, V and P are
+/// the camera it was rendered with. If nothing was traced since the last
+/// time (the camera moved and the image was resized in the same frame),
+/// the image holds nothing yet and the history is kept.
+///////////////////////////////////////////////////////////////////////////
+static void startReprojection(const mat4& V, const mat4& P)
+{
+	if(!history.active || !history.pending)
+	{
+		history.PV = P * V;
+		const mat4 inverse_V = inverse(V);
+		history.origin = vec3(inverse_V[3]);
+		history.forward = -normalize(vec3(inverse_V[2]));
+		history.width = rendered_image.width;
+		history.height = rendered_image.height;
+		history.color.swap(rendered_image.data);
+		history.sample_counts.swap(rendered_image.sample_counts);
+		history.luminance_squares.swap(rendered_image.luminance_squares);
+		history.aovs.depth.swap(aovs.depth);
+		history.aovs.normal.swap(aovs.normal);
+	}
+	const size_t num_pixels = size_t(rendered_image.width) * size_t(rendered_image.height);
+	rendered_image.data.resize(num_pixels);
+	rendered_image.sample_counts.assign(num_pixels, 0.0f);
+	rendered_image.luminance_squares.resize(num_pixels);
+	aovs.depth.resize(num_pixels);
+	aovs.normal.resize(num_pixels);
+	aovs.albedo.resize(num_pixels);
+	aovs.object_id.resize(num_pixels);
+	aovs.material_id.resize(num_pixels);
+	rendered_image.number_of_samples = 0;
+	primary_hit_cache.valid = false;
+	history.active = true;
+	history.pending = true;
+	resetAdaptiveSampling();
+	resetStatisticsAOVs();
+}
+
+///////////////////////////////////////////////////////////////////////////
+/// Start a pixel from the history pixels around where its primary hit was
+/// seen by the old camera. The valid ones of the four are interpolated
+/// bilinearly, and the sample count they carry over is clamped so that the
+/// reprojected (slightly blurred) color is soon outweighed by new samples.
+///////////////////////////////////////////////////////////////////////////
+static void reprojectPixel(int x, int y, const PrimaryHit& p, const Ray& ray)
+{
+	// A ray that escaped sees the environment in the same direction from
+	// any point, so it is projected as a direction
+	const vec4 clip = p.escaped ? history.PV * vec4(ray.d, 0.0f) : history.PV * vec4(p.hit.position, 1.0f);
+	vec3 color = vec3(0.0f);
+	float luminance_squares = 0.0f, samples = 0.0f, weight_sum = 0.0f;
+	if(clip.w > 0.0f)
+	{
+		const float fx = (0.5f * clip.x / clip.w + 0.5f) * float(history.width);
+		const float fy = (0.5f * clip.y / clip.w + 0.5f) * float(history.height);
+		const int x0 = int(floor(fx)), y0 = int(floor(fy));
+		const float tx = fx - float(x0), ty = fy - float(y0);
+		const float depth = p.escaped ? 0.0f : dot(p.hit.position - history.origin, history.forward);
+		for(int i = 0; i < 4; i++)
+		{
+			const int hx = x0 + (i & 1), hy = y0 + (i >> 1);
+			if(hx < 0 || hy < 0 || hx >= history.width || hy >= history.height)
+			{
+				continue;
+			}
+			const int h = hy * history.width + hx;
+			if(history.sample_counts[h] <= 0.0f)
+			{
+				continue;
+			}
+			const float history_depth = history.aovs.depth[h];
+			if(p.escaped ? history_depth != 0.0f :
+			               abs(history_depth - depth) > REPROJECTION_DEPTH_TOLERANCE * depth
+			                   || dot(history.aovs.normal[h], p.hit.shading_normal) < REPROJECTION_NORMAL_TOLERANCE)
+			{
+				continue;
+			}
+			const float w = ((i & 1) ? tx : 1.0f - tx) * ((i >> 1) ? ty : 1.0f - ty);
+			color += w * history.color[h];
+			luminance_squares += w * history.luminance_squares[h];
+			samples += w * history.sample_counts[h];
+			weight_sum += w;
+		}
+	}
+	const int i = y * rendered_image.width + x;
+	rendered_image.data[i] = weight_sum > 0.0f ? color / weight_sum : vec3(0.0f);
+	rendered_image.luminance_squares[i] = weight_sum > 0.0f ? luminance_squares / weight_sum : 0.0f;
+	rendered_image.sample_counts[i] = std::min(samples, float(settings.reprojection_max_samples));
+}
+
+///////////////////////////////////////////////////////////////////////////
+/// Store the result of an intersected primary ray in the cache and the
+/// AOVs, and reproject the pixel if this is the first pass after the
+/// camera moved
+///////////////////////////////////////////////////////////////////////////
+static const PrimaryHit& cachePrimaryHit(int x, int y, const Ray& ray, const Camera& camera)
+{
+	const int i = y * rendered_image.width + x;
+	PrimaryHit& p = primary_hit_cache.pixels[i];
+	p.escaped = ray.geomID == RTC_INVALID_GEOMETRY_ID;
+	if(p.escaped)
+	{
+		p.environment = Lenvironment(ray.d);
+		aovs.depth[i] = 0.0f;
+		aovs.normal[i] = vec3(0.0f);
+		aovs.albedo[i] = vec3(1.0f);
+		aovs.object_id[i] = RTC_INVALID_GEOMETRY_ID;
+		aovs.material_id[i] = RTC_INVALID_GEOMETRY_ID;
+	}
+	else
+	{
+		p.hit = getIntersection(ray);
+		aovs.depth[i] = camera.viewDepth(p.hit.position);
+		aovs.normal[i] = p.hit.shading_normal;
+		aovs.albedo[i] = p.hit.material->m_color;
+		aovs.object_id[i] = ray.instID != RTC_INVALID_GEOMETRY_ID ? ray.instID : ray.geomID;
+		aovs.material_id[i] = p.hit.material_index;
+	}
+	if(history.active)
+	{
+		reprojectPixel(x, y, p, ray);
+	}
+	return p;
+}
+
+///////////////////////////////////////////////////////////////////////////
+/// Wavefront path tracing of a tile. Instead of following one path at a
+/// time like Li(), all paths of the tile advance one bounce together:
+///   1. the rays of all live paths are intersected in one stream,
+///   2. the hits are sorted by material and shaded, which queues a shadow
+///      ray and the continuation ray of every path,
+///   3. the shadow rays are tested in one stream.
+/// Each stage runs a single kind of work over many paths, so its code and
+/// data stay in the caches. The result is the same as that of Li(), each
+/// path resumes its own random sequence when it is shaded.
+///////////////////////////////////////////////////////////////////////////
+struct WavefrontPath
+{
+	vec3 path_throughput;
+	float bounce_pdf;
+	// Where the last bounce was sampled, for the MIS weight of what it hits
+	vec3 bounce_position, bounce_normal;
+	int x, y;
+	uint32_t random_dimension;
+};
+
+struct WavefrontQueues
+{
+	// The radiance gathered so far, and the rays traced after the primary
+	// one, per pixel of the tile
+	std::vector<vec3> L;
+	std::vector<int> bounces;
+	std::vector<WavefrontPath> paths, next_paths;
+	std::vector<Ray> rays, next_rays;
+	std::vector<Intersection> hits;
+	std::vector<uint32_t> shading_order;
+	// The paths that escaped, and the environment in their directions
+	std::vector<uint32_t> escaped_paths;
+	std::vector<vec3> escaped_directions, escaped_radiance;
+	std::vector<Ray> shadow_rays;
+	std::vector<vec3> shadow_contributions;
+	std::vector<uint32_t> shadow_paths; // The pixel each shadow ray adds to
+	// The image pixel whose reservoir picked each shadow ray's light, or -1
+	std::vector<int> shadow_reservoirs;
+};
+
+static void traceTileWavefront(const Tile& tile, const Camera& camera, bool cached)
+{
+	// Kept between tiles so that the queues are only allocated once
+	static thread_local WavefrontQueues q;
+	const double start_time = settings.statistics_aovs ? omp_get_wtime() : 0.0;
+	const int tile_width = tile.x1 - tile.x0;
+	auto pixel = [&](const WavefrontPath& path) { return (path.y - tile.y0) * tile_width + (path.x - tile.x0); };
+	q.paths.clear();
+	q.rays.clear();
+	for(int y = tile.y0; y < tile.y1; y++)
+	{
+		for(int x = tile.x0; x < tile.x1; x++)
+		{
+			q.paths.push_back({ vec3(1.0f), 0.0f, vec3(0.0f), vec3(0.0f), x, y, CAMERA_RANDOM_DIMENSIONS });
+		}
+		if(!cached)
+		{
+			q.rays.resize(q.paths.size());
+			camera.generateRays(tile.x0, y, tile_width, rendered_image.number_of_samples,
+			                    &q.rays[q.paths.size() - tile_width]);
+		}
+	}
+	q.L.assign(q.paths.size(), vec3(0.0f));
+	q.bounces.assign(q.paths.size(), 0);
+	if(!cached)
+	{
+		intersectStream(q.rays.data(), q.rays.size(), true);
+		for(size_t i = 0; i < q.paths.size(); i++)
+		{
+			cachePrimaryHit(q.paths[i].x, q.paths[i].y, q.rays[i], camera);
+		}
+	}
+
+	for(int bounces = 0; !q.paths.empty(); bounces++)
+	{
+		///////////////////////////////////////////////////////////////////////
+		// Paths that escaped see the environment, the others are shaded in
+		// material order
+		///////////////////////////////////////////////////////////////////////
+		if(bounces > 0)
+		{
+			intersectStream(q.rays.data(), q.rays.size(), false);
+		}
+		q.hits.resize(q.paths.size());
+		q.shading_order.clear();
+		q.escaped_paths.clear();
+		q.escaped_directions.clear();
+		for(uint32_t i = 0; i < q.paths.size(); i++)
+		{
+			WavefrontPath& path = q.paths[i];
+			if(bounces == 0)
+			{
+				const PrimaryHit& p = primary_hit_cache.pixels[path.y * rendered_image.width + path.x];
+				if(p.escaped)
+				{
+					q.L[pixel(path)] += p.environment;
+					if(reservoirs.active)
+					{
+						reservoirs.pixels[path.y * rendered_image.width + path.x] = Reservoir();
+					}
+					continue;
+				}
+				q.hits[i] = p.hit;
 			}
 			else
 			{
-				// Otherwise evaluate environment
-				color = Lenvironment(primaryRay.d);
+				if(q.rays[i].geomID == RTC_INVALID_GEOMETRY_ID)
+				{
+					q.escaped_paths.push_back(i);
+					q.escaped_directions.push_back(q.rays[i].d);
+					continue;
+				}
+				q.hits[i] = getIntersection(q.rays[i]);
+			}
+			q.shading_order.push_back(i);
+		}
+		q.escaped_radiance.resize(q.escaped_paths.size());
+		environment.map.lookup(q.escaped_directions.data(), int(q.escaped_directions.size()),
+		                       q.escaped_radiance.data());
+		for(size_t e = 0; e < q.escaped_paths.size(); e++)
+		{
+			const WavefrontPath& path = q.paths[q.escaped_paths[e]];
+			q.L[pixel(path)] += path.path_throughput * environment.multiplier * q.escaped_radiance[e]
+			                    * escapedEnvironmentWeight(q.escaped_directions[e], path.bounce_pdf);
+		}
+		std::sort(q.shading_order.begin(), q.shading_order.end(), [](uint32_t a, uint32_t b) {
+			return q.hits[a].material < q.hits[b].material
+			       || (q.hits[a].material == q.hits[b].material && a < b);
+		});
+
+		q.next_paths.clear();
+		q.next_rays.clear();
+		q.shadow_rays.clear();
+		q.shadow_contributions.clear();
+		q.shadow_paths.clear();
+		q.shadow_reservoirs.clear();
+		for(uint32_t i : q.shading_order)
+		{
+			WavefrontPath& path = q.paths[i];
+			const Intersection& hit = q.hits[i];
+			seedRandom(path.x, path.y, rendered_image.number_of_samples, path.random_dimension);
+
+			// Primary hits count fully. Their rays are not traced in a cached
+			// pass, so q.rays only holds the rays of later bounces.
+			const vec3 emission = emittedRadiance(*hit.material, hit.uv);
+			if(emission != vec3(0.0f))
+			{
+				q.L[pixel(path)] += path.path_throughput * emission
+				                    * (bounces > 0 ? emissionWeight(q.rays[i], hit, path.bounce_position,
+				                                                    path.bounce_normal, path.bounce_pdf,
+				                                                    reservoirs.active && bounces == 1) :
+				                                     1.0f);
+			}
+
+			Diffuse diffuse(hit.material->m_color);
+			BTDF& mat = diffuse;
+
+			Ray shadow_ray;
+			if(reservoirs.active && bounces == 0)
+			{
+				vec3 Ld = resampleDirectLight(path.x, path.y, hit, mat, shadow_ray);
+				if(Ld != vec3(0.0f))
+				{
+					q.shadow_rays.push_back(shadow_ray);
+					q.shadow_contributions.push_back(path.path_throughput * Ld);
+					q.shadow_paths.push_back(uint32_t(pixel(path)));
+					q.shadow_reservoirs.push_back(path.y * rendered_image.width + path.x);
+				}
+			}
+			for(int l = 0; l < settings.light_samples && !(reservoirs.active && bounces == 0); l++)
+			{
+				vec3 Ld = sampleDirectLight(hit, mat, bounces >= settings.max_bounces, shadow_ray);
+				if(Ld != vec3(0.0f))
+				{
+					q.shadow_rays.push_back(shadow_ray);
+					q.shadow_contributions.push_back(path.path_throughput * Ld / float(settings.light_samples));
+					q.shadow_paths.push_back(uint32_t(pixel(path)));
+					q.shadow_reservoirs.push_back(-1);
+				}
+			}
+			if(isEnvironmentSampled())
+			{
+				vec3 Le = sampleEnvironmentLight(hit, mat, bounces >= settings.max_bounces, shadow_ray);
+				if(Le != vec3(0.0f))
+				{
+					q.shadow_rays.push_back(shadow_ray);
+					q.shadow_contributions.push_back(path.path_throughput * Le);
+					q.shadow_paths.push_back(uint32_t(pixel(path)));
+					q.shadow_reservoirs.push_back(-1);
+				}
+			}
+
+			Ray next_ray;
+			if(bounces < settings.max_bounces
+			   && sampleBounce(hit, mat, path.path_throughput, next_ray, path.bounce_pdf))
+			{
+				path.bounce_position = hit.position;
+				path.bounce_normal = hit.shading_normal;
+				path.random_dimension = getRandomDimension();
+				q.bounces[pixel(path)]++;
+				q.next_paths.push_back(path);
+				q.next_rays.push_back(next_ray);
+			}
+		}
+
+		///////////////////////////////////////////////////////////////////////
+		// Test all shadow rays of this bounce at once
+		///////////////////////////////////////////////////////////////////////
+		occludedStream(q.shadow_rays.data(), q.shadow_rays.size());
+		for(size_t i = 0; i < q.shadow_rays.size(); i++)
+		{
+			if(q.shadow_rays[i].geomID == RTC_INVALID_GEOMETRY_ID)
+			{
+				q.L[q.shadow_paths[i]] += q.shadow_contributions[i];
+			}
+			else if(q.shadow_reservoirs[i] >= 0)
+			{
+				discardReservoir(q.shadow_reservoirs[i]);
+			}
+		}
+		q.paths.swap(q.next_paths);
+		q.rays.swap(q.next_rays);
+	}
+
+	// The paths of a tile are traced together, so each pixel is given an
+	// equal share of the time
+	const double pixel_time =
+	    settings.statistics_aovs ? (omp_get_wtime() - start_time) / double(q.L.size()) : 0.0;
+	for(int y = tile.y0; y < tile.y1; y++)
+	{
+		for(int x = tile.x0; x < tile.x1; x++)
+		{
+			const int i = (y - tile.y0) * tile_width + (x - tile.x0);
+			accumulate(x, y, q.L[i]);
+			if(settings.statistics_aovs)
+			{
+				accumulateStatistics(x, y, q.bounces[i], pixel_time);
+			}
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+/// Path trace a tile one pixel at a time with Li()
+///////////////////////////////////////////////////////////////////////////
+static void traceTileScalar(const Tile& tile, const Camera& camera, bool cached)
+{
+	auto shade = [&](int x, int y, const PrimaryHit& primary) {
+		vec3 color;
+		int bounces = 0;
+		const double start_time = settings.statistics_aovs ? omp_get_wtime() : 0.0;
+		seedRandom(x, y, rendered_image.number_of_samples, CAMERA_RANDOM_DIMENSIONS);
+		if(!primary.escaped)
+		{
+			// If it hit something, evaluate the radiance from that point
+			color = Li(primary.hit, x, y, &bounces);
+		}
+		else
+		{
+			// Otherwise evaluate environment, there is no light to resample
+			color = primary.environment;
+			if(reservoirs.active)
+			{
+				reservoirs.pixels[y * rendered_image.width + x] = Reservoir();
+			}
+		}
+		// Accumulate the obtained radiance to the pixels color
+		accumulate(x, y, color);
+		if(settings.statistics_aovs)
+		{
+			accumulateStatistics(x, y, bounces, omp_get_wtime() - start_time);
+		}
+	};
+	if(cached)
+	{
+		for(int y = tile.y0; y < tile.y1; y++)
+		{
+			for(int x = tile.x0; x < tile.x1; x++)
+			{
+				shade(x, y, primary_hit_cache.pixels[y * rendered_image.width + x]);
 			}
-			// Accumulate the obtained radiance to the pixels color
-			float n = float(rendered_image.number_of_samples);
-			rendered_image.data[y * rendered_image.width + x] =
-			    rendered_image.data[y * rendered_image.width + x] * (n / (n + 1.0f))
-			    + (1.0f / (n + 1.0f)) * color;
 		}
 	}
+	else
+	{
+		traceTile(tile, camera, settings.packet_primary_rays,
+		          [&](int x, int y, Ray& primaryRay) { shade(x, y, cachePrimaryHit(x, y, primaryRay, camera)); });
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+/// Trace one path per pixel and accumulate the result in an image
+///////////////////////////////////////////////////////////////////////////
+bool tracePaths(const glm::mat4& V, const glm::mat4& P, double time_budget)
+{
+	///////////////////////////////////////////////////////////////////////
+	// Start a new pass, unless the last call ran out of time before the
+	// current one was done
+	///////////////////////////////////////////////////////////////////////
+	static struct Pass
+	{
+		mat4 V, P;
+		Camera camera;
+		bool use_cache, cached;
+		std::atomic<uint64_t> num_rays, num_samples;
+	} pass;
+	if(pass.V != V || pass.P != P)
+	{
+		tile_scheduler.abortPass();
+		if(settings.temporal_reprojection)
+		{
+			startReprojection(pass.V, pass.P);
+		}
+		else
+		{
+			restart();
+		}
+		pass.V = V;
+		pass.P = P;
+		history.image_V = V;
+		history.image_P = P;
+	}
+	if(!tile_scheduler.isPassInProgress())
+	{
+		// The tiles of adaptive sampling are those of the pass
+		const int tile_size = std::max(1, settings.tile_size);
+		const int tiles_x = (rendered_image.width + tile_size - 1) / tile_size;
+		const int tiles_y = (rendered_image.height + tile_size - 1) / tile_size;
+		if(tiles_x != adaptive.tiles_x || tiles_y != adaptive.tiles_y || tile_size != adaptive.tile_size)
+		{
+			adaptive.tiles_x = tiles_x;
+			adaptive.tiles_y = tiles_y;
+			adaptive.tile_size = tile_size;
+			adaptive.tile_errors.resize(tiles_x * tiles_y);
+			adaptive.converged.resize(tiles_x * tiles_y);
+			resetAdaptiveSampling();
+		}
+		// Stop here if we have as many samples as we want
+		if(isRenderingDone())
+		{
+			return true;
+		}
+		pass.V = V;
+		pass.P = P;
+		pass.camera.jitter = settings.jitter;
+		pass.camera.lens_radius = settings.lens_radius;
+		pass.camera.focus_distance = settings.focus_distance;
+		pass.camera.sampler = settings.sampler == RANDOM_SAMPLER ? nullptr : &getSampler(settings.sampler);
+		setSampler(settings.sampler);
+		// Points on lights that changed can not be reused
+		if(updateLights())
+		{
+			reservoirs.pixels.clear();
+		}
+		reservoirs.active = settings.restir;
+		if(reservoirs.active)
+		{
+			startResampling(V, P);
+		}
+		pass.camera.setup(V, P, rendered_image.width, rendered_image.height);
+		// Primary hits are only traced again if something changed since the
+		// last pass. With jitter or depth of field every pass has new ones.
+		pass.use_cache = settings.cache_primary_hits && pass.camera.isDeterministic();
+		pass.cached = pass.use_cache && primary_hit_cache.valid && primary_hit_cache.V == V
+		              && primary_hit_cache.P == P
+		              && primary_hit_cache.environment_multiplier == environment.multiplier;
+		primary_hit_cache.pixels.resize(rendered_image.width * rendered_image.height);
+		pass.num_rays = 0;
+		pass.num_samples = 0;
+		tile_scheduler.startPass(rendered_image.width, rendered_image.height, settings.tile_size);
+	}
+	const Camera& camera = pass.camera;
+	const bool cached = pass.cached;
+	std::atomic<uint64_t>& num_rays = pass.num_rays;
+
+	// Trace one path per pixel. The tile scheduler distributes the tiles of
+	// the image on all cores of your CPU.
+	const bool complete = tile_scheduler.run([&](const Tile& tile) {
+		const int tile_index = adaptiveTileIndex(tile);
+		if(settings.adaptive_sampling && adaptive.converged[tile_index])
+		{
+			return;
+		}
+		pass.num_samples += uint64_t((tile.x1 - tile.x0) * (tile.y1 - tile.y0));
+		if(settings.wavefront)
+		{
+			traceTileWavefront(tile, camera, cached);
+		}
+		else
+		{
+			traceTileScalar(tile, camera, cached);
+		}
+		num_rays += takeRayCount();
+
+		float min_samples;
+		adaptive.tile_errors[tile_index] = tileError(tile, min_samples);
+		if(settings.adaptive_sampling && min_samples >= ADAPTIVE_MIN_SAMPLES
+		   && adaptive.tile_errors[tile_index] < settings.adaptive_threshold)
+		{
+			adaptive.converged[tile_index] = 1;
+			adaptive.num_converged++;
+		}
+	}, time_budget);
+	if(pass.num_samples > 0)
+	{
+		history.pending = false;
+	}
+	if(!complete)
+	{
+		return false;
+	}
+	primary_hit_cache.valid = pass.use_cache;
+	primary_hit_cache.V = V;
+	primary_hit_cache.P = P;
+	primary_hit_cache.environment_multiplier = environment.multiplier;
 	rendered_image.number_of_samples += 1;
+	history.active = false;
+	adaptive.samples += pass.num_samples;
+
+	statistics.pass_time = tile_scheduler.getRunTime();
+	statistics.pass_rays = num_rays;
+	statistics.pass_samples = pass.num_samples;
+	statistics.image_error = 0.0f;
+	for(float e : adaptive.tile_errors)
+	{
+		statistics.image_error += e / float(adaptive.tile_errors.size());
+	}
+	statistics.converged_tiles = float(adaptive.num_converged) / float(adaptive.tile_errors.size());
+	statistics.thread_utilization.clear();
+	for(const auto& thread : tile_scheduler.getThreadStats())
+	{
+		statistics.thread_utilization.push_back(float(thread.busy_time / statistics.pass_time));
+	}
+	return true;
+}
+
+double benchmarkPrimaryRays(const mat4& V, const mat4& P, bool packets)
+{
+	Camera camera;
+	camera.setup(V, P, rendered_image.width, rendered_image.height);
+	// Not the global scheduler, which may be in the middle of a pass
+	TileScheduler scheduler;
+	scheduler.run(rendered_image.width, rendered_image.height, settings.tile_size, [&](const Tile& tile) {
+		traceTile(tile, camera, packets, [](int, int, Ray&) {});
+		takeRayCount();
+	});
+	const double num_rays = double(rendered_image.width) * double(rendered_image.height);
+	return num_rays / scheduler.getRunTime();
+}
+
+void denoiseImage(std::vector<vec3>& output, double time_cap)
+{
+	denoiser.denoise(rendered_image, aovs, settings.denoise_iterations, time_cap, output);
+}
+
+///////////////////////////////////////////////////////////////////////////
+/// Write an image as <filename>.hdr, and as <filename>.png with the colors
+/// to_png(i) gives its pixels i, in [0, 1]. Row 0 of the image is the bottom row, so
+/// flip it. Returns false if a file could not be written.
+///////////////////////////////////////////////////////////////////////////
+template<typename F>
+static bool writeImage(const std::string& filename, const vector<vec3>& image, const F& to_png)
+{
+	const int w = rendered_image.width;
+	const int h = rendered_image.height;
+	vector<float> img(w * h * 3);
+	vector<uint8_t> img_png(w * h * 3);
+	for(int y = 0; y < h; y++)
+	{
+		for(int x = 0; x < w; x++)
+		{
+			const int pixel = (h - 1 - y) * w + x;
+			const vec3& c = image[pixel];
+			const vec3 c_png = clamp(to_png(pixel), vec3(0.0f), vec3(1.0f));
+			for(int i = 0; i < 3; i++)
+			{
+				img[(y * w + x) * 3 + i] = c[i];
+				img_png[(y * w + x) * 3 + i] = uint8_t(255 * c_png[i]);
+			}
+		}
+	}
+	bool written = true;
+	if(!stbi_write_hdr((filename + ".hdr").c_str(), w, h, 3, img.data()))
+	{
+		cout << "Failed to write image: " << filename << ".hdr\n";
+		written = false;
+	}
+	if(!stbi_write_png((filename + ".png").c_str(), w, h, 3, img_png.data(), 0))
+	{
+		cout << "Failed to write image: " << filename << ".png\n";
+		written = false;
+	}
+	return written;
+}
+
+///////////////////////////////////////////////////////////////////////////
+/// Save the rendered image as <filename>.hdr and a tonemapped
+/// <filename>.png
+///////////////////////////////////////////////////////////////////////////
+bool saveImage(const std::string& filename, bool denoised)
+{
+	vector<vec3> denoised_image;
+	if(denoised)
+	{
+		denoiseImage(denoised_image);
+	}
+	const vector<vec3>& image = denoised ? denoised_image : rendered_image.data;
+	return writeImage(filename, image, [&](int i) { return image[i] / (1.0f + image[i]); });
+}
+
+///////////////////////////////////////////////////////////////////////////
+/// A color that is the same for every pixel with the same id, and differs
+/// (most likely) between ids. Black for RTC_INVALID_GEOMETRY_ID.
+///////////////////////////////////////////////////////////////////////////
+static vec3 idColor(uint32_t id)
+{
+	if(id == RTC_INVALID_GEOMETRY_ID)
+	{
+		return vec3(0.0f);
+	}
+	uint32_t hash = (id + 1) * 0x9E3779B1u;
+	hash ^= hash >> 15;
+	hash *= 0x85EBCA77u;
+	hash ^= hash >> 13;
+	return vec3(float(hash & 0xFF), float((hash >> 8) & 0xFF), float((hash >> 16) & 0xFF)) / 255.0f;
+}
+
+bool saveAOV(const std::string& filename, int type)
+{
+	const size_t num_pixels = rendered_image.data.size();
+	vector<vec3> image(num_pixels);
+	for(size_t i = 0; i < num_pixels; i++)
+	{
+		const float samples = std::max(aovs.statistics_samples[i], 1.0f);
+		switch(type)
+		{
+		case ALBEDO_AOV: image[i] = aovs.albedo[i]; break;
+		case NORMAL_AOV: image[i] = aovs.normal[i]; break;
+		case DEPTH_AOV: image[i] = vec3(aovs.depth[i]); break;
+		case OBJECT_ID_AOV: image[i] = vec3(float(int(aovs.object_id[i]))); break;
+		case MATERIAL_ID_AOV: image[i] = vec3(float(int(aovs.material_id[i]))); break;
+		case BOUNCES_AOV: image[i] = vec3(aovs.bounces[i] / samples); break;
+		case TIME_AOV: image[i] = vec3(aovs.time[i] / samples); break;
+		}
+	}
+
+	if(type == OBJECT_ID_AOV || type == MATERIAL_ID_AOV)
+	{
+		// The .hdr has the ids, -1 where the ray escaped
+		const vector<uint32_t>& ids = type == OBJECT_ID_AOV ? aovs.object_id : aovs.material_id;
+		return writeImage(filename, image, [&](int i) { return idColor(ids[i]); });
+	}
+	else if(type == NORMAL_AOV)
+	{
+		return writeImage(filename, image, [&](int i) { return image[i] * 0.5f + 0.5f; });
+	}
+	else if(type == ALBEDO_AOV)
+	{
+		return writeImage(filename, image, [&](int i) { return image[i]; });
+	}
+	else
+	{
+		float max_value = 0.0f;
+		for(const vec3& c : image)
+		{
+			max_value = std::max(max_value, c.x);
+		}
+		const float scale = max_value > 0.0f ? 1.0f / max_value : 0.0f;
+		return writeImage(filename, image, [&](int i) { return image[i] * scale; });
+	}
 }
 }; // namespace pathtracer
@@ -3,7 +3,7 @@
 #include <vector>
 #include <Model.h>
 #include <omp.h>
-#include "HDRImage.h"
+#include "EnvironmentMap.h"
 
 #ifdef M_PI
 #undef M_PI
@@ -26,6 +26,30 @@ extern struct Settings
 	int subsampling;
 	int max_bounces;
 	int max_paths_per_pixel;
+	int tile_size; // Width and height in pixels of the tiles a pass is split into
+	bool packet_primary_rays; // Trace primary rays in packets of neighbouring pixels
+	bool wavefront; // Advance all paths of a tile one bounce at a time, instead of Li()
+	bool cache_primary_hits; // Reuse the primary hits of the last pass while nothing changes
+	bool jitter; // Stratified sub-pixel positions (anti-aliasing)
+	float lens_radius; // Thin lens depth of field, 0 for a pinhole camera
+	float focus_distance;
+	bool temporal_reprojection; // Keep what is still visible of the image when the camera moves
+	int reprojection_max_samples; // The most samples a reprojected pixel counts as
+	bool adaptive_sampling; // Stop sampling tiles once they have converged
+	float adaptive_threshold; // Relative error at which a tile has converged
+	float adaptive_sample_budget; // Samples per pixel on average the image may take, 0 = no limit
+	int sampler; // SamplerType of the random numbers
+	bool denoise; // Show the image denoised
+	int denoise_iterations;
+	float denoise_time_cap; // Milliseconds per denoised image, 0 = no cap
+	bool statistics_aovs; // Fill the bounces and time AOVs
+	bool environment_sampling; // Sample directions toward the environment map, and weight them with MIS
+	int light_sampler; // LightSamplerType that picks the light to sample direct lighting from
+	int light_samples; // Lights sampled (and shadow rays traced) per bounce
+	bool emissive_lights; // Sample emissive triangles as lights, and weight the hits on them with MIS
+	bool restir; // Resample the direct lighting of primary hits with ReSTIR, see Reservoirs
+	int restir_candidates; // Lights sampled per pixel and pass for ReSTIR
+	int restir_spatial_samples; // Neighbouring reservoirs a pixel reuses, at most RESTIR_MAX_SPATIAL_SAMPLES
 };
 extern Settings settings;
 
@@ -35,7 +59,7 @@ extern Settings settings;
 extern struct Environment
 {
 	float multiplier;
-	HDRImage map;
+	EnvironmentMap map;
 };
 extern Environment environment;
 
@@ -46,6 +70,12 @@ extern struct Image
 {
 	int width, height, number_of_samples = 0;
 	std::vector<glm::vec3> data;
+	// The number of samples averaged in each pixel. The same as
+	// number_of_samples, unless the pixel was reprojected or its tile
+	// converged.
+	std::vector<float> sample_counts;
+	// The average of the squared luminance of the samples, for the variance
+	std::vector<float> luminance_squares;
 	float* getPtr()
 	{
 		return &data[0].x;
@@ -53,6 +83,93 @@ extern struct Image
 };
 extern Image rendered_image;
 
+///////////////////////////////////////////////////////////////////////////
+// Arbitrary output variables: per pixel buffers next to the rendered
+// image, indexed the same way. The first hit AOVs are those of the last
+// primary ray traced through the pixel, and are written from the hit that
+// is shaded anyway. The statistics AOVs are sums over the samples taken
+// since the restart (or the camera moved), with settings.statistics_aovs.
+///////////////////////////////////////////////////////////////////////////
+extern struct AOVs
+{
+	std::vector<float> depth; // Linear (view space) depth, 0 if the ray escaped
+	std::vector<glm::vec3> normal; // Shading normal
+	std::vector<glm::vec3> albedo; // Material color, 1 if the ray escaped
+	// Embree geometry (instance) id of the model, and index of the
+	// material in it. RTC_INVALID_GEOMETRY_ID if the ray escaped.
+	std::vector<uint32_t> object_id;
+	std::vector<uint32_t> material_id;
+
+	std::vector<float> bounces; // Rays traced after the primary one
+	std::vector<float> time; // Seconds spent shading
+	std::vector<float> statistics_samples;
+};
+extern AOVs aovs;
+
+enum AOVType
+{
+	ALBEDO_AOV,
+	NORMAL_AOV,
+	DEPTH_AOV,
+	OBJECT_ID_AOV,
+	MATERIAL_ID_AOV,
+	BOUNCES_AOV,
+	TIME_AOV,
+	NUM_AOV_TYPES
+};
+extern const char* aov_names[NUM_AOV_TYPES];
+
+///////////////////////////////////////////////////////////////////////////
+// ReSTIR reservoirs, per pixel like the image. With settings.restir the
+// direct lighting of each primary hit is one light point, resampled out of
+// the pixel's new candidates and the reservoirs of the last pass, at the
+// pixel the hit was seen at and around it. A reservoir keeps the point it
+// picked and what it takes to reuse it, see resampleDirectLight().
+///////////////////////////////////////////////////////////////////////////
+struct Reservoir
+{
+	// A light of the light sampler and the uniform numbers that pick the
+	// point on it, light is -1 if there is none
+	int light = -1;
+	glm::vec2 u;
+	float M = 0.0f; // The number of candidates it was picked out of
+	float W = 0.0f; // The contribution weight of the point, 0 if it is occluded
+	// The primary hit it was resampled for
+	glm::vec3 position, normal;
+};
+const int RESTIR_MAX_SPATIAL_SAMPLES = 8;
+
+extern struct Reservoirs
+{
+	bool active = false; // The pass being traced resamples
+	std::vector<Reservoir> pixels;
+	// The reservoirs of the last pass, which the pass being traced reuses,
+	// and the camera they were made with
+	std::vector<Reservoir> previous;
+	glm::mat4 previous_PV;
+	// The camera of the pass being traced
+	glm::mat4 PV;
+	glm::vec3 origin;
+};
+extern Reservoirs reservoirs;
+
+///////////////////////////////////////////////////////////////////////////
+// Timing and ray counts of the last pass completed by tracePaths()
+///////////////////////////////////////////////////////////////////////////
+extern struct Statistics
+{
+	double pass_time = 0.0; // In seconds
+	uint64_t pass_rays = 0;
+	uint64_t pass_samples = 0;
+	// Fraction of the pass each thread spent rendering tiles
+	std::vector<float> thread_utilization;
+	// Estimated relative error of the image, and the fraction of its tiles
+	// that adaptive sampling has stopped sampling
+	float image_error = 1.0f;
+	float converged_tiles = 0.0f;
+};
+extern Statistics statistics;
+
 ///////////////////////////////////////////////////////////////////////////////
 // The light sources
 ///////////////////////////////////////////////////////////////////////////////
@@ -64,6 +181,8 @@ struct PointLight
 };
 extern PointLight point_light;
 
+// Shines out of its front side (direction), with intensity_multiplier *
+// color along the direction
 struct DiscLight
 {
 	float intensity_multiplier;
@@ -74,6 +193,11 @@ struct DiscLight
 };
 extern std::vector<DiscLight> disc_lights;
 
+///////////////////////////////////////////////////////////////////////////
+/// Load the environment map and build the distribution it is sampled with
+///////////////////////////////////////////////////////////////////////////
+void loadEnvironment(const std::string& filename);
+
 ///////////////////////////////////////////////////////////////////////////
 /// Restart rendering of image
 ///////////////////////////////////////////////////////////////////////////
@@ -84,6 +208,13 @@ void restart();
 ///////////////////////////////////////////////////////////////////////////
 int getSampleCount();
 
+///////////////////////////////////////////////////////////////////////////
+/// True once the image has max_paths_per_pixel samples, or adaptive
+/// sampling has found every tile converged or spent the sample budget.
+/// tracePaths() does nothing then.
+///////////////////////////////////////////////////////////////////////////
+bool isRenderingDone();
+
 ///////////////////////////////////////////////////////////////////////////
 /// On window resize, window size is passed in, actual size of pathtraced
 /// image may be smaller (if we're subsampling for speed)
@@ -91,7 +222,46 @@ int getSampleCount();
 void resize(int w, int h);
 
 ///////////////////////////////////////////////////////////////////////////
-/// Trace one path per pixel
+/// Trace one path per pixel. With a time budget (in seconds), stops when
+/// it runs out and continues the same pass in the next call. Returns true
+/// once the pass is complete. If V or P differ from the last call, the
+/// image is reprojected to the new camera (with temporal_reprojection) or
+/// restarted.
+///////////////////////////////////////////////////////////////////////////
+bool tracePaths(const mat4& V, const mat4& P, double time_budget = 0.0);
+
+///////////////////////////////////////////////////////////////////////////
+/// Make a tracePaths() call running on another thread return as soon as
+/// possible (without losing its work), and keep later calls from tracing
+/// until interruptTracing(false).
+///////////////////////////////////////////////////////////////////////////
+void interruptTracing(bool interrupt);
+
+///////////////////////////////////////////////////////////////////////////
+/// Trace (but do not shade) the primary rays of the whole image, either one
+/// at a time or in packets. Returns the number of primary rays per second.
+///////////////////////////////////////////////////////////////////////////
+double benchmarkPrimaryRays(const mat4& V, const mat4& P, bool packets);
+
+///////////////////////////////////////////////////////////////////////////
+/// Filter the noise out of the rendered image into output, guided by the
+/// AOVs (see Denoiser.h). With a time cap (in seconds), fewer iterations
+/// than settings.denoise_iterations may be done.
+///////////////////////////////////////////////////////////////////////////
+void denoiseImage(std::vector<glm::vec3>& output, double time_cap = 0.0);
+
+///////////////////////////////////////////////////////////////////////////
+/// Save the rendered image, or the denoised one, as <filename>.hdr and a
+/// tonemapped <filename>.png. Returns false if a file could not be written.
+///////////////////////////////////////////////////////////////////////////
+bool saveImage(const std::string& filename, bool denoised = false);
+
+///////////////////////////////////////////////////////////////////////////
+/// Save an AOV as <filename>.hdr with its values, and <filename>.png
+/// scaled to be visible: normals to [0, 1], depth, bounces and time by
+/// their maximum, and ids as a random color per id. The statistics AOVs
+/// are saved as averages per sample. Returns false if a file could not be
+/// written.
 ///////////////////////////////////////////////////////////////////////////
-void tracePaths(const mat4& V, const mat4& P);
+bool saveAOV(const std::string& filename, int type);
 }; // namespace pathtracer
@@ -0,0 +1,115 @@
+#include "RenderThread.h"
+#include "Pathtracer.h"
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// Tracing goes on in slices of this many seconds, so that a pause that
+// comes in just before a slice starts waits at most this long
+///////////////////////////////////////////////////////////////////////////
+static const double slice_time = 0.05;
+
+void RenderThread::start()
+{
+	quit = false;
+	thread = std::thread([this]() { run(); });
+}
+
+void RenderThread::stop()
+{
+	{
+		auto paused = pause();
+		quit = true;
+	}
+	resumed.notify_all();
+	thread.join();
+}
+
+unique_lock<mutex> RenderThread::pause()
+{
+	pause_requests++;
+	interruptTracing(true);
+	unique_lock<mutex> paused(lock);
+	// The render thread can not trace without the lock, so from here on it
+	// only has to wait for the lock to be released
+	if(--pause_requests == 0)
+	{
+		interruptTracing(false);
+	}
+	resumed.notify_all();
+	return paused;
+}
+
+void RenderThread::setCamera(const mat4& view, const mat4& projection)
+{
+	V = view;
+	P = projection;
+	has_camera = true;
+}
+
+void RenderThread::run()
+{
+	unique_lock<mutex> locked(lock);
+	for(;;)
+	{
+		resumed.wait(locked, [this]() { return quit || (has_camera && pause_requests == 0); });
+		if(quit)
+		{
+			return;
+		}
+		const int number_of_samples = rendered_image.number_of_samples;
+		if(tracePaths(V, P, slice_time))
+		{
+			if(rendered_image.number_of_samples != number_of_samples)
+			{
+				publish();
+			}
+			else
+			{
+				// All samples are done, wait for something to change
+				resumed.wait_for(locked, chrono::milliseconds(10));
+			}
+		}
+		// Let a pending pause() have the lock
+		locked.unlock();
+		this_thread::yield();
+		locked.lock();
+	}
+}
+
+void RenderThread::publish()
+{
+	Snapshot& back = snapshots[1 - front];
+	back.width = rendered_image.width;
+	back.height = rendered_image.height;
+	back.number_of_samples = rendered_image.number_of_samples;
+	if(settings.denoise)
+	{
+		denoiseImage(back.data, settings.denoise_time_cap / 1000.0);
+	}
+	else
+	{
+		back.data = rendered_image.data;
+	}
+	{
+		lock_guard<mutex> guard(snapshot_lock);
+		front = 1 - front;
+	}
+	completed_passes++;
+}
+
+bool RenderThread::readSnapshot(uint64_t& version, const function<void(const Snapshot&)>& read)
+{
+	lock_guard<mutex> guard(snapshot_lock);
+	if(version == completed_passes)
+	{
+		return false;
+	}
+	version = completed_passes;
+	read(snapshots[front]);
+	return true;
+}
+} // namespace pathtracer
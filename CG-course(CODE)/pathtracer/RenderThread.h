@@ -0,0 +1,71 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <cstdint>
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// Calls tracePaths() continuously on a thread of its own, so that the
+// display loop and the pathtracer each run at their own rate.
+//
+// Pathtracer state (settings, scene, camera, image size) may only be
+// changed while holding the lock returned by pause(), which interrupts
+// the pass being traced between two tiles. Every completed pass is copied
+// into a double buffered snapshot that can be read at any time with
+// readSnapshot().
+///////////////////////////////////////////////////////////////////////////
+class RenderThread
+{
+public:
+	struct Snapshot
+	{
+		int width = 0, height = 0;
+		int number_of_samples = 0;
+		std::vector<glm::vec3> data;
+	};
+
+	void start();
+	void stop();
+
+	// Stop tracing until the returned lock is released
+	std::unique_lock<std::mutex> pause();
+
+	// The camera of the passes traced from now on. Call while paused.
+	void setCamera(const glm::mat4& V, const glm::mat4& P);
+
+	// Number of passes completed since start()
+	uint64_t getCompletedPasses() const
+	{
+		return completed_passes;
+	}
+
+	// Call read(snapshot) if a pass was completed since `version`, which is
+	// then updated. Returns false if there was nothing new.
+	bool readSnapshot(uint64_t& version, const std::function<void(const Snapshot&)>& read);
+
+private:
+	void run();
+	void publish();
+
+	std::thread thread;
+	std::mutex lock;
+	std::condition_variable resumed;
+	std::atomic<int> pause_requests{ 0 };
+	bool quit = false;
+	glm::mat4 V, P;
+	bool has_camera = false;
+	std::atomic<uint64_t> completed_passes{ 0 };
+
+	// The front snapshot is read by readSnapshot(), the back one is filled
+	// by the render thread and then swapped with it
+	std::mutex snapshot_lock;
+	Snapshot snapshots[2];
+	int front = 0;
+};
+} // namespace pathtracer
@@ -0,0 +1,196 @@
+#include "TileScheduler.h"
+#include <algorithm>
+#include <cstdint>
+#include <cfloat>
+#include <omp.h>
+
+using namespace std;
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// Interleave the bits of x and y (16 bits each) into a Morton code
+///////////////////////////////////////////////////////////////////////////
+static uint32_t spreadBits(uint32_t v)
+{
+	v &= 0x0000FFFF;
+	v = (v | (v << 8)) & 0x00FF00FF;
+	v = (v | (v << 4)) & 0x0F0F0F0F;
+	v = (v | (v << 2)) & 0x33333333;
+	v = (v | (v << 1)) & 0x55555555;
+	return v;
+}
+
+static uint32_t mortonCode(uint32_t x, uint32_t y)
+{
+	return spreadBits(x) | (spreadBits(y) << 1);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// The tile list only changes with the image size, so it is cached between
+// passes.
+///////////////////////////////////////////////////////////////////////////
+void TileScheduler::buildTiles(int width, int height, int tile_size)
+{
+	if(width == tiles_width && height == tiles_height && tile_size == tiles_size)
+	{
+		return;
+	}
+	tiles_width = width;
+	tiles_height = height;
+	tiles_size = tile_size;
+
+	const int nx = (width + tile_size - 1) / tile_size;
+	const int ny = (height + tile_size - 1) / tile_size;
+	vector<pair<uint32_t, Tile>> ordered;
+	ordered.reserve(nx * ny);
+	for(int ty = 0; ty < ny; ty++)
+	{
+		for(int tx = 0; tx < nx; tx++)
+		{
+			Tile t;
+			t.x0 = tx * tile_size;
+			t.y0 = ty * tile_size;
+			t.x1 = std::min(t.x0 + tile_size, width);
+			t.y1 = std::min(t.y0 + tile_size, height);
+			ordered.push_back(make_pair(mortonCode(tx, ty), t));
+		}
+	}
+	std::sort(ordered.begin(), ordered.end(),
+	          [](const pair<uint32_t, Tile>& a, const pair<uint32_t, Tile>& b) { return a.first < b.first; });
+	tiles.resize(ordered.size());
+	for(size_t i = 0; i < ordered.size(); i++)
+	{
+		tiles[i] = ordered[i].second;
+	}
+}
+
+bool TileScheduler::popTile(int thread, int& tile_index)
+{
+	Queue& q = queues[thread];
+	lock_guard<mutex> guard(q.lock);
+	if(q.begin == q.end)
+	{
+		return false;
+	}
+	tile_index = q.begin++;
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Move the back half of the first non-empty queue we find into our own
+// (empty) queue. Returns false when there is no work left anywhere.
+///////////////////////////////////////////////////////////////////////////
+bool TileScheduler::stealTiles(int thread)
+{
+	const int num_queues = int(queues.size());
+	for(int i = 1; i < num_queues; i++)
+	{
+		Queue& victim = queues[(thread + i) % num_queues];
+		int begin, end;
+		{
+			lock_guard<mutex> guard(victim.lock);
+			if(victim.begin == victim.end)
+			{
+				continue;
+			}
+			end = victim.end;
+			begin = victim.end - std::max(1, (victim.end - victim.begin) / 2);
+			victim.end = begin;
+		}
+		Queue& own = queues[thread];
+		lock_guard<mutex> guard(own.lock);
+		own.begin = begin;
+		own.end = end;
+		return true;
+	}
+	return false;
+}
+
+void TileScheduler::run(int width, int height, int tile_size, const function<void(const Tile&)>& render_tile)
+{
+	startPass(width, height, tile_size);
+	run(render_tile);
+}
+
+void TileScheduler::startPass(int width, int height, int tile_size)
+{
+	buildTiles(width, height, std::max(1, tile_size));
+
+	///////////////////////////////////////////////////////////////////////
+	// Deal out contiguous runs of the morton ordered tiles. If the parallel
+	// region gets fewer threads than this, the unused queues are stolen.
+	///////////////////////////////////////////////////////////////////////
+	const int num_threads = omp_get_max_threads();
+	if(int(queues.size()) != num_threads)
+	{
+		vector<Queue> new_queues(num_threads);
+		queues.swap(new_queues);
+	}
+	const int num_tiles = int(tiles.size());
+	for(int i = 0; i < num_threads; i++)
+	{
+		queues[i].begin = int((int64_t(num_tiles) * i) / num_threads);
+		queues[i].end = int((int64_t(num_tiles) * (i + 1)) / num_threads);
+	}
+	thread_stats.assign(num_threads, ThreadStats());
+	run_time = 0.0;
+	aborted = false;
+	pass_in_progress = true;
+}
+
+bool TileScheduler::run(const function<void(const Tile&)>& render_tile, double time_budget)
+{
+	if(!isPassInProgress())
+	{
+		// An aborted pass is never complete
+		pass_in_progress = false;
+		return !aborted;
+	}
+	const double start_time = omp_get_wtime();
+	const double deadline = time_budget > 0.0 ? start_time + time_budget : DBL_MAX;
+	const int num_threads = int(queues.size());
+	std::atomic<bool> out_of_time(false);
+
+#pragma omp parallel num_threads(num_threads)
+	{
+		const int thread = omp_get_thread_num();
+		ThreadStats& stats = thread_stats[thread];
+		int tile_index;
+		for(;;)
+		{
+			if(aborted || interrupted || out_of_time)
+			{
+				break;
+			}
+			if(omp_get_wtime() >= deadline)
+			{
+				out_of_time = true;
+				break;
+			}
+			if(!popTile(thread, tile_index))
+			{
+				if(!stealTiles(thread))
+				{
+					break;
+				}
+				stats.steals++;
+				continue;
+			}
+			const double tile_start = omp_get_wtime();
+			render_tile(tiles[tile_index]);
+			stats.busy_time += omp_get_wtime() - tile_start;
+			stats.tiles++;
+		}
+	}
+	run_time += omp_get_wtime() - start_time;
+
+	bool complete = !aborted;
+	for(const Queue& q : queues)
+	{
+		complete = complete && q.begin == q.end;
+	}
+	pass_in_progress = !complete && !aborted;
+	return complete;
+}
+} // namespace pathtracer
@@ -0,0 +1,109 @@
+#pragma once
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <functional>
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// A rectangle of pixels [x0, x1) x [y0, y1) of the rendered image
+///////////////////////////////////////////////////////////////////////////
+struct Tile
+{
+	int x0, y0, x1, y1;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Splits the image into square tiles ordered along a Morton curve, so that
+// neighbouring tiles (and the BVH nodes and texels they touch) are rendered
+// close together in time. Each thread gets its own contiguous run of tiles
+// and, once it runs out, steals half of the remaining tiles from another
+// thread. This keeps all cores busy until the end of the pass even when
+// some parts of the image are far more expensive than others.
+//
+// A pass can be rendered in several calls to run() with a time budget
+// each. Tiles are not split, so a call overshoots its budget by at most
+// one tile per thread.
+///////////////////////////////////////////////////////////////////////////
+class TileScheduler
+{
+public:
+	struct ThreadStats
+	{
+		double busy_time = 0.0; // Seconds spent rendering tiles
+		int tiles = 0;
+		int steals = 0;
+	};
+
+	// Render every tile of a width x height image once, in parallel
+	void run(int width, int height, int tile_size, const std::function<void(const Tile&)>& render_tile);
+
+	// Start a pass over every tile of a width x height image
+	void startPass(int width, int height, int tile_size);
+
+	// Render tiles of the current pass in parallel until all of them are
+	// done, or until time_budget seconds have passed (0 means no limit).
+	// Returns true if the pass is complete.
+	bool run(const std::function<void(const Tile&)>& render_tile, double time_budget = 0.0);
+
+	// True between startPass() and the run() that completes the pass,
+	// unless the pass was aborted
+	bool isPassInProgress() const
+	{
+		return pass_in_progress && !aborted;
+	}
+
+	// Drop the remaining tiles of the current pass. Can be called from
+	// another thread while run() is rendering, which then returns as soon
+	// as the tiles being rendered are done.
+	void abortPass()
+	{
+		aborted = true;
+	}
+
+	// While interrupted, run() returns as soon as the tiles being rendered
+	// are done, and the pass stays in progress. Can be called from another
+	// thread.
+	void setInterrupted(bool interrupt)
+	{
+		interrupted = interrupt;
+	}
+
+	// Per thread statistics of the current (or last) pass
+	const std::vector<ThreadStats>& getThreadStats() const
+	{
+		return thread_stats;
+	}
+
+	// Wall clock time of the current (or last) pass, in seconds, summed over
+	// the calls to run()
+	double getRunTime() const
+	{
+		return run_time;
+	}
+
+private:
+	// The tiles [begin, end) of the morton ordered list still to be rendered
+	// by one thread. The owner takes from the front, thieves from the back.
+	struct Queue
+	{
+		std::mutex lock;
+		int begin = 0, end = 0;
+		char padding[64]; // Keep queues of different threads on separate cache lines
+	};
+
+	void buildTiles(int width, int height, int tile_size);
+	bool popTile(int thread, int& tile_index);
+	bool stealTiles(int thread);
+
+	std::vector<Tile> tiles;
+	int tiles_width = 0, tiles_height = 0, tiles_size = 0;
+	std::vector<Queue> queues;
+	std::vector<ThreadStats> thread_stats;
+	double run_time = 0.0;
+	bool pass_in_progress = false;
+	std::atomic<bool> aborted{ false };
+	std::atomic<bool> interrupted{ false };
+};
+} // namespace pathtracer
@@ -1,6 +1,13 @@
 #include "embree.h"
 #include <iostream>
+#include <chrono>
+#include <cstring>
 #include <map>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <glm/gtc/matrix_inverse.hpp>
 
 
 using namespace std;
@@ -12,32 +19,339 @@ namespace pathtracer
 // Global variables
 ///////////////////////////////////////////////////////////////////////////
 RTCDevice embree_device = nullptr;
-RTCScene embree_scene = nullptr;
 
-///////////////////////////////////////////////////////////////////////////
-// Build an acceleration structure for the scene
-///////////////////////////////////////////////////////////////////////////
-void buildBVH()
-{
-	cout << "Embree building BVH..." << flush;
-	rtcCommit(embree_scene);
-	cout << "done.\n";
-}
+// The widest ray packet the CPU (and the embree build) supports, and the
+// scene flags that enable it and the stream API, if available
+int packet_width = 4;
+bool stream_supported = false;
+RTCAlgorithmFlags scene_algorithm_flags = RTCAlgorithmFlags(RTC_INTERSECT1 | RTC_INTERSECT4);
+
+// Counted per thread so that intersect() and occluded() need no
+// synchronization.
+thread_local uint64_t rays_traced = 0;
 
 ///////////////////////////////////////////////////////////////////////////
 // Called when there is an embree error
 ///////////////////////////////////////////////////////////////////////////
 void embreeErrorHandler(void* userval, const RTCError code, const char* str)
 {
+	if(code == RTC_CANCELLED)
+	{
+		// We asked for it, see cancelBuild()
+		return;
+	}
 	cout << "Embree ERROR: " << str << endl;
 	exit(1);
 }
 
 ///////////////////////////////////////////////////////////////////////////
-// Used to map an Embree geometry ID to our scene Meshes and Materials
+// Everything getIntersection() needs to know about a hit triangle, packed
+// into 40 bytes. They are not padded to a cache line, which would take 60%
+// more memory, so a hit reads one cache line or, for half of the triangles,
+// two. Normals are in object space and stored octahedron encoded in 2x16
+// bits.
+///////////////////////////////////////////////////////////////////////////
+struct TriangleAttributes
+{
+	uint32_t normals[3];
+	vec2 uvs[3];
+	uint32_t material_index; // Index into Model::m_materials
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Used to map an Embree geometry ID and primitive ID to the attributes of
+// the hit triangle. Embree hands out geometry IDs sequentially, so a flat
+// array indexed by geomID replaces a map lookup. A geometry of the top
+// level scene is either a mesh or an instance of a model's prototype
+// scene, in which case the ray's geomID indexes the prototype's geometries.
+///////////////////////////////////////////////////////////////////////////
+struct GeometryRecord
+{
+	const TriangleAttributes* triangles = nullptr;
+	const labhelper::Material* materials = nullptr;
+	const vector<GeometryRecord>* instanced_geometries = nullptr;
+	mat3 normal_matrix = mat3(1.0f);
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Octahedral normal encoding, see "A Survey of Efficient Representations
+// for Independent Unit Vectors" (Cigolle et al. 2014)
+///////////////////////////////////////////////////////////////////////////
+static vec2 signNotZero(vec2 v)
+{
+	return vec2(v.x >= 0.0f ? 1.0f : -1.0f, v.y >= 0.0f ? 1.0f : -1.0f);
+}
+
+static uint32_t packNormal(vec3 n)
+{
+	n /= (abs(n.x) + abs(n.y) + abs(n.z));
+	vec2 p = vec2(n);
+	if(n.z < 0.0f)
+	{
+		p = (1.0f - abs(vec2(p.y, p.x))) * signNotZero(p);
+	}
+	uvec2 q = uvec2(round(clamp(p * 0.5f + 0.5f, 0.0f, 1.0f) * 65535.0f));
+	return q.x | (q.y << 16);
+}
+
+static vec3 unpackNormal(uint32_t packed)
+{
+	vec2 p = vec2(float(packed & 0xFFFF), float(packed >> 16)) * (2.0f / 65535.0f) - 1.0f;
+	vec3 n = vec3(p.x, p.y, 1.0f - abs(p.x) - abs(p.y));
+	if(n.z < 0.0f)
+	{
+		vec2 xy = (1.0f - abs(vec2(n.y, n.x))) * signNotZero(vec2(n));
+		n.x = xy.x;
+		n.y = xy.y;
+	}
+	// The decoded vector has unit L1 length, interpolating it as it is
+	// would weight the vertices unevenly
+	return normalize(n);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Everything we derive from a Model for ray tracing. It only depends on the
+// Model, so it is built once and kept (and shared with embree) for as long
+// as the program runs.
+//
+// The Model buffers store three vertices per triangle. Before handing a
+// mesh to embree we weld vertices with identical positions and build a
+// real index buffer, which cuts the vertex memory of the BVH input several
+// times.
+///////////////////////////////////////////////////////////////////////////
+struct WeldedMesh
+{
+	// Padded with zeroes to a multiple of 16 bytes, as embree reads vertices
+	// with SSE loads
+	vector<vec3> positions;
+	uint32_t number_of_vertices;
+	vector<uint32_t> indices;
+};
+
+struct ModelData
+{
+	vector<WeldedMesh> meshes;
+	vector<TriangleAttributes> triangles;
+	// A scene holding the untransformed meshes, built the first time the
+	// model is instanced.
+	RTCScene prototype = nullptr;
+	vector<GeometryRecord> prototype_geometries;
+	vector<uint32_t> prototype_geom_IDs; // Of each mesh
+};
+map<const labhelper::Model*, ModelData> model_data;
+// Scenes may be built on a background thread while the main thread moves
+// dynamic models, so access to model_data is locked.
+mutex model_data_lock;
+
+struct PositionHash
+{
+	size_t operator()(const vec3& p) const
+	{
+		uint32_t bits[3];
+		memcpy(bits, &p.x, sizeof(bits));
+		return size_t(bits[0] * 73856093u ^ bits[1] * 19349663u ^ bits[2] * 83492791u);
+	}
+};
+
+ModelData& getModelData(const labhelper::Model* model)
+{
+	lock_guard<mutex> guard(model_data_lock);
+	auto it = model_data.find(model);
+	if(it != model_data.end())
+	{
+		return it->second;
+	}
+	ModelData& data = model_data[model];
+	data.meshes.resize(model->m_meshes.size());
+	for(size_t m = 0; m < model->m_meshes.size(); m++)
+	{
+		const labhelper::Mesh& mesh = model->m_meshes[m];
+		WeldedMesh& w = data.meshes[m];
+		unordered_map<vec3, uint32_t, PositionHash> vertex_index;
+		vertex_index.reserve(mesh.m_number_of_vertices);
+		w.indices.resize(mesh.m_number_of_vertices);
+		for(uint32_t i = 0; i < mesh.m_number_of_vertices; i++)
+		{
+			const vec3& p = model->m_positions[mesh.m_start_index + i];
+			auto inserted = vertex_index.insert(make_pair(p, uint32_t(w.positions.size())));
+			if(inserted.second)
+			{
+				w.positions.push_back(p);
+			}
+			w.indices[i] = inserted.first->second;
+		}
+		w.number_of_vertices = uint32_t(w.positions.size());
+		do
+		{
+			w.positions.push_back(vec3(0.0f));
+		} while((w.positions.size() * sizeof(vec3)) % 16 != 0);
+	}
+
+	// The mesh vertices are consecutive in the Model buffers, so triangle
+	// m_start_index / 3 + primID belongs to primitive primID of a mesh.
+	data.triangles.resize(model->m_positions.size() / 3);
+	for(const auto& mesh : model->m_meshes)
+	{
+		for(uint32_t i = mesh.m_start_index; i < mesh.m_start_index + mesh.m_number_of_vertices; i += 3)
+		{
+			TriangleAttributes& t = data.triangles[i / 3];
+			for(int j = 0; j < 3; j++)
+			{
+				t.normals[j] = packNormal(normalize(model->m_normals[i + j]));
+				t.uvs[j] = model->m_texture_coordinates[i + j];
+			}
+			t.material_index = mesh.m_material_idx;
+		}
+	}
+	return data;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Write the transformed vertices of a mesh into embree's vertex buffer
 ///////////////////////////////////////////////////////////////////////////
-map<uint32_t, const labhelper::Model*> map_geom_ID_to_model;
-map<uint32_t, const labhelper::Mesh*> map_geom_ID_to_mesh;
+void transformVertices(RTCScene scene, uint32_t geom_ID, const WeldedMesh& w, const mat4& model_matrix)
+{
+	vec4* embree_vertices = (vec4*)rtcMapBuffer(scene, geom_ID, RTC_VERTEX_BUFFER);
+	for(uint32_t i = 0; i < w.number_of_vertices; i++)
+	{
+		embree_vertices[i] = model_matrix * vec4(w.positions[i], 1.0f);
+	}
+	rtcUnmapBuffer(scene, geom_ID, RTC_VERTEX_BUFFER);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Add a model's meshes as geometries to an embree scene. Vertices of
+// static geometry are shared as they are unless they need to be
+// transformed. Returns the number of (welded) vertices added.
+///////////////////////////////////////////////////////////////////////////
+size_t addMeshes(RTCScene scene,
+                 vector<GeometryRecord>& records,
+                 const labhelper::Model* model,
+                 const ModelData& data,
+                 const mat4& model_matrix,
+                 RTCGeometryFlags flags,
+                 vector<uint32_t>* geom_IDs = nullptr)
+{
+	const mat3 normal_matrix = inverseTranspose(mat3(model_matrix));
+	const bool share_vertices = (flags == RTC_GEOMETRY_STATIC) && (model_matrix == mat4(1.0f));
+	size_t number_of_vertices = 0;
+	for(size_t m = 0; m < model->m_meshes.size(); m++)
+	{
+		const labhelper::Mesh& mesh = model->m_meshes[m];
+		const WeldedMesh& w = data.meshes[m];
+		uint32_t geom_ID = rtcNewTriangleMesh(scene, flags, mesh.m_number_of_vertices / 3, w.number_of_vertices);
+		if(geom_ID >= records.size())
+		{
+			records.resize(geom_ID + 1);
+		}
+		records[geom_ID].triangles = &data.triangles[mesh.m_start_index / 3];
+		records[geom_ID].materials = model->m_materials.data();
+		records[geom_ID].normal_matrix = normal_matrix;
+		if(geom_IDs)
+		{
+			geom_IDs->push_back(geom_ID);
+		}
+
+		if(share_vertices)
+		{
+			rtcSetBuffer2(scene, geom_ID, RTC_VERTEX_BUFFER, w.positions.data(), 0, sizeof(vec3),
+			              w.number_of_vertices);
+		}
+		else
+		{
+			transformVertices(scene, geom_ID, w, model_matrix);
+		}
+		// Triangle indices are always shared
+		rtcSetBuffer2(scene, geom_ID, RTC_INDEX_BUFFER, w.indices.data(), 0, 3 * sizeof(uint32_t),
+		              mesh.m_number_of_vertices / 3);
+		number_of_vertices += w.number_of_vertices;
+	}
+	return number_of_vertices;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// The prototype scene of a model that is placed several times
+///////////////////////////////////////////////////////////////////////////
+RTCScene getPrototype(const labhelper::Model* model, ModelData& data)
+{
+	lock_guard<mutex> guard(model_data_lock);
+	if(!data.prototype)
+	{
+		cout << "Building instanced " << model->m_name << "..." << flush;
+		data.prototype = rtcDeviceNewScene(embree_device, RTC_SCENE_STATIC, scene_algorithm_flags);
+		size_t number_of_vertices = addMeshes(data.prototype, data.prototype_geometries, model, data, mat4(1.0f),
+		                                      RTC_GEOMETRY_STATIC, &data.prototype_geom_IDs);
+		rtcCommit(data.prototype);
+		cout << "done (" << model->m_positions.size() << " vertices welded to " << number_of_vertices << ").\n";
+	}
+	return data.prototype;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// A model added with addModel(). They are turned into embree geometry when
+// the scene is built, when we know which models are placed more than once
+// and whether any of them will move.
+///////////////////////////////////////////////////////////////////////////
+struct SceneModel
+{
+	const labhelper::Model* model;
+	mat4 model_matrix;
+	bool dynamic;
+	// The meshes of a model that is not instanced, so that dynamic ones can
+	// be moved later. Its instance, if it is instanced or its meshes are in
+	// the static scene.
+	vector<uint32_t> geom_IDs;
+	uint32_t inst_ID = RTC_INVALID_GEOMETRY_ID;
+	bool moved;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// An embree scene together with what we need to shade its hits. Named
+// scenes are kept after they have been replaced, so that switching back to
+// them does not build them again.
+///////////////////////////////////////////////////////////////////////////
+struct SceneBVH
+{
+	string name;
+	RTCScene scene = nullptr;
+	vector<GeometryRecord> geometries;
+	// The static models of a scene with dynamic ones, instanced into it once
+	RTCScene static_scene = nullptr;
+	vector<GeometryRecord> static_geometries;
+	vector<SceneModel> models;
+	~SceneBVH()
+	{
+		if(scene)
+		{
+			rtcDeleteScene(scene);
+		}
+		if(static_scene)
+		{
+			rtcDeleteScene(static_scene);
+		}
+	}
+};
+
+// The scene that intersect() and occluded() trace
+SceneBVH* current_scene = nullptr;
+// The scene that addModel() adds to
+SceneBVH* pending_scene = nullptr;
+map<string, SceneBVH*> cached_scenes;
+
+///////////////////////////////////////////////////////////////////////////
+// A scene being built on a worker thread. The worker only touches `scene`
+// and the atomics, the main thread picks the result up in swapScene().
+///////////////////////////////////////////////////////////////////////////
+struct BackgroundBuild
+{
+	thread worker;
+	SceneBVH* scene = nullptr;
+	atomic<bool> finished;
+	atomic<bool> cancelled;
+	atomic<float> progress;
+	double build_time = 0.0;
+};
+BackgroundBuild background_build;
 
 void initEmbree()
 {
@@ -51,7 +365,22 @@ void initEmbree()
 		embree_is_initialized = true;
 		embree_device = rtcNewDevice();
 		rtcDeviceSetErrorFunction2(embree_device, embreeErrorHandler, nullptr);
-		cout << "done.\n";
+		if(rtcDeviceGetParameter1i(embree_device, RTC_CONFIG_INTERSECT16))
+		{
+			packet_width = 16;
+			scene_algorithm_flags = RTCAlgorithmFlags(RTC_INTERSECT1 | RTC_INTERSECT16);
+		}
+		else if(rtcDeviceGetParameter1i(embree_device, RTC_CONFIG_INTERSECT8))
+		{
+			packet_width = 8;
+			scene_algorithm_flags = RTCAlgorithmFlags(RTC_INTERSECT1 | RTC_INTERSECT8);
+		}
+		if(rtcDeviceGetParameter1i(embree_device, RTC_CONFIG_INTERSECT_STREAM))
+		{
+			stream_supported = true;
+			scene_algorithm_flags = RTCAlgorithmFlags(scene_algorithm_flags | RTC_INTERSECT_STREAM);
+		}
+		cout << "done (ray packets of " << packet_width << ").\n";
 	}
 }
 
@@ -59,55 +388,350 @@ void reinitScene()
 {
 	initEmbree();
 
-	if(embree_scene)
-	{
-		rtcDeleteScene(embree_scene);
-	}
-
-	embree_scene = rtcDeviceNewScene(embree_device, RTC_SCENE_STATIC, RTC_INTERSECT1);
+	delete pending_scene;
+	pending_scene = new SceneBVH;
 }
 
 ///////////////////////////////////////////////////////////////////////////
 // Add a model to the embree scene
 ///////////////////////////////////////////////////////////////////////////
-void addModel(const labhelper::Model* model, const mat4& model_matrix)
+uint32_t addModel(const labhelper::Model* model, const mat4& model_matrix, bool dynamic)
 {
 	///////////////////////////////////////////////////////////////////////
 	// Lazy initialize embree on first use
 	///////////////////////////////////////////////////////////////////////
-	if(!embree_scene)
+	if(!pending_scene)
 	{
 		reinitScene();
 	}
+	SceneModel o;
+	o.model = model;
+	o.model_matrix = model_matrix;
+	o.dynamic = dynamic;
+	o.moved = false;
+	pending_scene->models.push_back(o);
+	return uint32_t(pending_scene->models.size() - 1);
+}
 
-	///////////////////////////////////////////////////////////////////////
-	// Transform and add each mesh in the model as a geometry in embree,
-	// and create mappings so that we can connect an embree geom_ID to a
-	// Material.
-	///////////////////////////////////////////////////////////////////////
-	cout << "Adding " << model->m_name << " to embree scene..." << flush;
-	for(auto& mesh : model->m_meshes)
-	{
-		uint32_t geom_ID = rtcNewTriangleMesh(embree_scene, RTC_GEOMETRY_STATIC,
-		                                      mesh.m_number_of_vertices / 3, mesh.m_number_of_vertices);
-		map_geom_ID_to_mesh[geom_ID] = &mesh;
-		map_geom_ID_to_model[geom_ID] = model;
-		// Transform and commit vertices
-		vec4* embree_vertices = (vec4*)rtcMapBuffer(embree_scene, geom_ID, RTC_VERTEX_BUFFER);
-		for(uint32_t i = 0; i < mesh.m_number_of_vertices; i++)
+///////////////////////////////////////////////////////////////////////////
+// Move a dynamic model. The new vertices are written right away, but the
+// BVH is only refitted by updateBVH().
+///////////////////////////////////////////////////////////////////////////
+void setModelTransform(uint32_t handle, const mat4& model_matrix)
+{
+	if(!current_scene)
+	{
+		return;
+	}
+	SceneModel& o = current_scene->models[handle];
+	if(!o.dynamic)
+	{
+		cout << "setModelTransform(): " << o.model->m_name << " was not added as a dynamic model.\n";
+		return;
+	}
+	o.model_matrix = model_matrix;
+	o.moved = true;
+	const ModelData& data = getModelData(o.model);
+	const mat3 normal_matrix = inverseTranspose(mat3(model_matrix));
+	for(size_t m = 0; m < o.geom_IDs.size(); m++)
+	{
+		transformVertices(current_scene->scene, o.geom_IDs[m], data.meshes[m], model_matrix);
+		rtcUpdateBuffer(current_scene->scene, o.geom_IDs[m], RTC_VERTEX_BUFFER);
+		current_scene->geometries[o.geom_IDs[m]].normal_matrix = normal_matrix;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Refit the BVH of the dynamic models that moved since the last update
+///////////////////////////////////////////////////////////////////////////
+double updateBVH()
+{
+	if(!current_scene)
+	{
+		return 0.0;
+	}
+	bool any_moved = false;
+	for(auto& o : current_scene->models)
+	{
+		any_moved = any_moved || o.moved;
+		o.moved = false;
+	}
+	if(!any_moved)
+	{
+		return 0.0;
+	}
+	auto start_time = chrono::steady_clock::now();
+	rtcCommit(current_scene->scene);
+	chrono::duration<double> update_time = chrono::steady_clock::now() - start_time;
+	return update_time.count();
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Emissive triangles are taken from the Model buffers, where each triangle
+// has its own three vertices. Materials are checked every time, since their
+// emission can be edited.
+///////////////////////////////////////////////////////////////////////////
+void getEmissiveTriangles(vector<EmissiveTriangle>& triangles)
+{
+	triangles.clear();
+	if(!current_scene)
+	{
+		return;
+	}
+	for(const auto& o : current_scene->models)
+	{
+		const labhelper::Model* model = o.model;
+		const ModelData& data = getModelData(model);
+		for(size_t m = 0; m < model->m_meshes.size(); m++)
 		{
-			embree_vertices[i] = model_matrix * vec4(model->m_positions[mesh.m_start_index + i], 1.0f);
+			const labhelper::Mesh& mesh = model->m_meshes[m];
+			const labhelper::Material& material = model->m_materials[mesh.m_material_idx];
+			if(material.m_emission == vec3(0.0f) && !material.m_emission_texture.valid)
+			{
+				continue;
+			}
+			EmissiveTriangle t;
+			t.material = &material;
+			t.inst_ID = o.inst_ID;
+			t.geom_ID = o.geom_IDs.empty() ? data.prototype_geom_IDs[m] : o.geom_IDs[m];
+			for(uint32_t i = 0; i < mesh.m_number_of_vertices / 3; i++)
+			{
+				t.prim_ID = i;
+				for(int j = 0; j < 3; j++)
+				{
+					const uint32_t vertex = mesh.m_start_index + 3 * i + j;
+					t.positions[j] = vec3(o.model_matrix * vec4(model->m_positions[vertex], 1.0f));
+					t.uvs[j] = model->m_texture_coordinates[vertex];
+				}
+				triangles.push_back(t);
+			}
 		}
-		rtcUnmapBuffer(embree_scene, geom_ID, RTC_VERTEX_BUFFER);
-		// Commit triangle indices
-		int* embree_tri_idxs = (int*)rtcMapBuffer(embree_scene, geom_ID, RTC_INDEX_BUFFER);
-		for(uint32_t i = 0; i < mesh.m_number_of_vertices; i++)
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Called by embree during a background build. Returning false cancels it.
+///////////////////////////////////////////////////////////////////////////
+bool buildProgressMonitor(void* ptr, const double n)
+{
+	BackgroundBuild* build = (BackgroundBuild*)ptr;
+	build->progress = 0.5f + 0.5f * float(n);
+	return !build->cancelled;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Build an acceleration structure for a scene. A model that is placed
+// once has its (transformed) meshes added directly to the scene. A model
+// that is placed several times is built once into a prototype scene, and
+// every placement becomes an instance of it, so that memory and build
+// time do not grow with the number of copies.
+//
+// If any model is dynamic the scene is created with RTC_SCENE_DYNAMIC.
+// Embree then keeps one BVH per geometry under a small top level BVH, and
+// a commit after setModelTransform() only refits the (deformable) meshes
+// that moved. The static models are built into a static scene of their
+// own, instanced once, so they are never rebuilt and are traced through a
+// BVH as good as that of a fully static scene. Embree 2 can not instance a
+// scene that holds instances, so in a scene with models placed several
+// times they are separate static geometries of the dynamic scene instead.
+//
+// Returns false if the build was cancelled.
+///////////////////////////////////////////////////////////////////////////
+bool buildScene(SceneBVH& s, BackgroundBuild* build)
+{
+	bool any_dynamic = false, any_instanced = false;
+	map<const labhelper::Model*, int> placements;
+	for(const auto& o : s.models)
+	{
+		any_dynamic = any_dynamic || o.dynamic;
+		if(!o.dynamic)
+		{
+			any_instanced = any_instanced || ++placements[o.model] > 1;
+		}
+	}
+	s.scene = rtcDeviceNewScene(embree_device, any_dynamic ? RTC_SCENE_DYNAMIC : RTC_SCENE_STATIC,
+	                            scene_algorithm_flags);
+	if(any_dynamic && !any_instanced)
+	{
+		s.static_scene = rtcDeviceNewScene(embree_device, RTC_SCENE_STATIC, scene_algorithm_flags);
+	}
+	for(size_t i = 0; i < s.models.size(); i++)
+	{
+		SceneModel& o = s.models[i];
+		if(build)
+		{
+			if(build->cancelled)
+			{
+				return false;
+			}
+			build->progress = 0.5f * float(i) / float(s.models.size());
+		}
+		ModelData& data = getModelData(o.model);
+		if(o.dynamic)
+		{
+			cout << "Adding dynamic " << o.model->m_name << " to embree scene..." << flush;
+			o.geom_IDs.clear();
+			addMeshes(s.scene, s.geometries, o.model, data, o.model_matrix, RTC_GEOMETRY_DEFORMABLE, &o.geom_IDs);
+			o.moved = false;
+			cout << "done.\n";
+			continue;
+		}
+		if(placements[o.model] == 1)
+		{
+			cout << "Adding " << o.model->m_name << " to embree scene..." << flush;
+			o.geom_IDs.clear();
+			size_t number_of_vertices =
+			    s.static_scene ? addMeshes(s.static_scene, s.static_geometries, o.model, data, o.model_matrix,
+			                               RTC_GEOMETRY_STATIC, &o.geom_IDs) :
+			                     addMeshes(s.scene, s.geometries, o.model, data, o.model_matrix, RTC_GEOMETRY_STATIC,
+			                               &o.geom_IDs);
+			cout << "done (" << o.model->m_positions.size() << " vertices welded to " << number_of_vertices
+			     << ").\n";
+			continue;
+		}
+		uint32_t inst_ID = rtcNewInstance2(s.scene, getPrototype(o.model, data));
+		rtcSetTransform2(s.scene, inst_ID, RTC_MATRIX_COLUMN_MAJOR_ALIGNED16, &o.model_matrix[0].x);
+		o.inst_ID = inst_ID;
+		if(inst_ID >= s.geometries.size())
+		{
+			s.geometries.resize(inst_ID + 1);
+		}
+		s.geometries[inst_ID].instanced_geometries = &data.prototype_geometries;
+		s.geometries[inst_ID].normal_matrix = inverseTranspose(mat3(o.model_matrix));
+	}
+	if(s.static_scene)
+	{
+		rtcCommit(s.static_scene);
+		const mat4 identity = mat4(1.0f);
+		const uint32_t inst_ID = rtcNewInstance2(s.scene, s.static_scene);
+		rtcSetTransform2(s.scene, inst_ID, RTC_MATRIX_COLUMN_MAJOR_ALIGNED16, &identity[0].x);
+		if(inst_ID >= s.geometries.size())
+		{
+			s.geometries.resize(inst_ID + 1);
+		}
+		s.geometries[inst_ID].instanced_geometries = &s.static_geometries;
+		for(SceneModel& o : s.models)
+		{
+			if(!o.dynamic)
+			{
+				o.inst_ID = inst_ID;
+			}
+		}
+	}
+
+	cout << "Embree building BVH..." << flush;
+	if(build)
+	{
+		rtcSetProgressMonitorFunction(s.scene, buildProgressMonitor, build);
+	}
+	rtcCommit(s.scene);
+	if(build)
+	{
+		rtcSetProgressMonitorFunction(s.scene, nullptr, nullptr);
+		if(build->cancelled)
+		{
+			cout << "cancelled.\n";
+			return false;
+		}
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Make a built scene the one we trace. The previous scene is kept if it is
+// cached under a name.
+///////////////////////////////////////////////////////////////////////////
+void makeCurrent(SceneBVH* s)
+{
+	if(current_scene && current_scene->name.empty())
+	{
+		delete current_scene;
+	}
+	current_scene = s;
+	if(!s->name.empty())
+	{
+		cached_scenes[s->name] = s;
+	}
+}
+
+double buildBVH(const string& name)
+{
+	cancelBuild();
+	auto start_time = chrono::steady_clock::now();
+	SceneBVH* s = pending_scene;
+	pending_scene = nullptr;
+	s->name = name;
+	buildScene(*s, nullptr);
+	makeCurrent(s);
+	chrono::duration<double> build_time = chrono::steady_clock::now() - start_time;
+	cout << "done (" << build_time.count() * 1000.0 << " ms).\n";
+	return build_time.count();
+}
+
+void buildBVHAsync(const string& name)
+{
+	cancelBuild();
+	BackgroundBuild& build = background_build;
+	build.scene = pending_scene;
+	build.scene->name = name;
+	pending_scene = nullptr;
+	build.finished = false;
+	build.cancelled = false;
+	build.progress = 0.0f;
+	build.worker = thread([&build]() {
+		auto start_time = chrono::steady_clock::now();
+		bool completed = buildScene(*build.scene, &build);
+		chrono::duration<double> build_time = chrono::steady_clock::now() - start_time;
+		build.build_time = build_time.count();
+		if(completed)
 		{
-			embree_tri_idxs[i] = i;
+			cout << "done (" << build.build_time * 1000.0 << " ms, in the background).\n";
 		}
-		rtcUnmapBuffer(embree_scene, geom_ID, RTC_INDEX_BUFFER);
+		build.finished = true;
+	});
+}
+
+float getBuildProgress()
+{
+	return background_build.scene ? background_build.progress.load() : -1.0f;
+}
+
+void cancelBuild()
+{
+	BackgroundBuild& build = background_build;
+	if(!build.scene)
+	{
+		return;
+	}
+	build.cancelled = true;
+	build.worker.join();
+	delete build.scene;
+	build.scene = nullptr;
+}
+
+bool swapScene()
+{
+	BackgroundBuild& build = background_build;
+	if(!build.scene || !build.finished)
+	{
+		return false;
 	}
-	cout << "done.\n";
+	build.worker.join();
+	makeCurrent(build.scene);
+	build.scene = nullptr;
+	return true;
+}
+
+bool useCachedScene(const string& name)
+{
+	auto it = cached_scenes.find(name);
+	if(it == cached_scenes.end())
+	{
+		return false;
+	}
+	cancelBuild();
+	makeCurrent(it->second);
+	return true;
 }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -115,23 +739,39 @@ void addModel(const labhelper::Model* model, const mat4& model_matrix)
 ///////////////////////////////////////////////////////////////////////////
 Intersection getIntersection(const Ray& r)
 {
-	const labhelper::Model* model = map_geom_ID_to_model[r.geomID];
-	const labhelper::Mesh* mesh = map_geom_ID_to_mesh[r.geomID];
+	const GeometryRecord* g;
+	// Of the shading normals, and of the geometry normal of instanced hits
+	mat3 normal_matrix, geometry_normal_matrix;
+	if(r.instID == RTC_INVALID_GEOMETRY_ID)
+	{
+		g = &current_scene->geometries[r.geomID];
+		normal_matrix = g->normal_matrix;
+	}
+	else
+	{
+		// Embree reports the geometry normal of instanced hits in the space
+		// of the instanced scene. The meshes of the static scene are placed
+		// in it already, prototype meshes are not, and our shading normals
+		// are in the space of the model in both cases.
+		const GeometryRecord& instance = current_scene->geometries[r.instID];
+		g = &(*instance.instanced_geometries)[r.geomID];
+		geometry_normal_matrix = instance.normal_matrix;
+		normal_matrix = instance.normal_matrix * g->normal_matrix;
+	}
+	const TriangleAttributes& t = g->triangles[r.primID];
 	Intersection i;
-	i.material = &(model->m_materials[mesh->m_material_idx]);
-	vec3 n0 = model->m_normals[((mesh->m_start_index / 3) + r.primID) * 3 + 0];
-	vec3 n1 = model->m_normals[((mesh->m_start_index / 3) + r.primID) * 3 + 1];
-	vec3 n2 = model->m_normals[((mesh->m_start_index / 3) + r.primID) * 3 + 2];
+	i.material = &g->materials[t.material_index];
+	i.material_index = t.material_index;
+	vec3 n0 = unpackNormal(t.normals[0]);
+	vec3 n1 = unpackNormal(t.normals[1]);
+	vec3 n2 = unpackNormal(t.normals[2]);
 	float w = 1.0f - (r.u + r.v);
-	i.shading_normal = normalize(w * n0 + r.u * n1 + r.v * n2);
-	i.geometry_normal = -normalize(r.n);
+	i.shading_normal = normalize(normal_matrix * (w * n0 + r.u * n1 + r.v * n2));
+	i.geometry_normal = -normalize(r.instID == RTC_INVALID_GEOMETRY_ID ? r.n : geometry_normal_matrix * r.n);
 	i.position = r.o + r.tfar * r.d;
 	i.wo = normalize(-r.d);
 
-	vec2 uv0 = model->m_texture_coordinates[((mesh->m_start_index / 3) + r.primID) * 3 + 0];
-	vec2 uv1 = model->m_texture_coordinates[((mesh->m_start_index / 3) + r.primID) * 3 + 1];
-	vec2 uv2 = model->m_texture_coordinates[((mesh->m_start_index / 3) + r.primID) * 3 + 2];
-	i.uv = w * uv0 + r.u * uv1 + r.v * uv2;
+	i.uv = w * t.uvs[0] + r.u * t.uvs[1] + r.v * t.uvs[2];
 	return i;
 }
 
@@ -140,17 +780,126 @@ Intersection getIntersection(const Ray& r)
 ///////////////////////////////////////////////////////////////////////////
 bool intersect(Ray& r)
 {
-	rtcIntersect(embree_scene, *((RTCRay*)&r));
+	rays_traced++;
+	rtcIntersect(current_scene->scene, *((RTCRay*)&r));
 	return r.geomID != RTC_INVALID_GEOMETRY_ID;
 }
 
+///////////////////////////////////////////////////////////////////////////
+// Copy rays into an SoA packet, trace it, and copy the hits back
+///////////////////////////////////////////////////////////////////////////
+template<typename RTCRayN, int N>
+void intersectPacketN(void (*rtcIntersectN)(const void*, RTCScene, RTCRayN&), Ray* rays, const bool* valid)
+{
+	RTCRayN packet;
+	alignas(64) int valid_mask[N];
+	for(int i = 0; i < N; i++)
+	{
+		const Ray& r = rays[i];
+		valid_mask[i] = valid[i] ? -1 : 0;
+		packet.orgx[i] = r.o.x;
+		packet.orgy[i] = r.o.y;
+		packet.orgz[i] = r.o.z;
+		packet.dirx[i] = r.d.x;
+		packet.diry[i] = r.d.y;
+		packet.dirz[i] = r.d.z;
+		packet.tnear[i] = r.tnear;
+		packet.tfar[i] = r.tfar;
+		packet.time[i] = r.time;
+		packet.mask[i] = r.mask;
+		packet.geomID[i] = RTC_INVALID_GEOMETRY_ID;
+		packet.primID[i] = RTC_INVALID_GEOMETRY_ID;
+		packet.instID[i] = RTC_INVALID_GEOMETRY_ID;
+	}
+	rtcIntersectN(valid_mask, current_scene->scene, packet);
+	for(int i = 0; i < N; i++)
+	{
+		if(!valid[i])
+		{
+			continue;
+		}
+		Ray& r = rays[i];
+		r.tfar = packet.tfar[i];
+		r.n = vec3(packet.Ngx[i], packet.Ngy[i], packet.Ngz[i]);
+		r.u = packet.u[i];
+		r.v = packet.v[i];
+		r.geomID = packet.geomID[i];
+		r.primID = packet.primID[i];
+		r.instID = packet.instID[i];
+		rays_traced++;
+	}
+}
+
+void intersectPacket(Ray* rays, const bool* valid)
+{
+	switch(packet_width)
+	{
+	case 16: intersectPacketN<RTCRay16, 16>(rtcIntersect16, rays, valid); break;
+	case 8: intersectPacketN<RTCRay8, 8>(rtcIntersect8, rays, valid); break;
+	default: intersectPacketN<RTCRay4, 4>(rtcIntersect4, rays, valid); break;
+	}
+}
+
+int getPacketWidth()
+{
+	initEmbree();
+	return packet_width;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Trace a stream of rays. Embree reorders them into packets internally, so
+// unlike intersectPacket() the rays do not have to be coherent. Without
+// stream support in the embree build, they are traced one at a time.
+///////////////////////////////////////////////////////////////////////////
+void intersectStream(Ray* rays, size_t count, bool coherent)
+{
+	rays_traced += count;
+	if(!stream_supported)
+	{
+		for(size_t i = 0; i < count; i++)
+		{
+			rtcIntersect(current_scene->scene, *((RTCRay*)&rays[i]));
+		}
+		return;
+	}
+	RTCIntersectContext context;
+	context.flags = coherent ? RTC_INTERSECT_COHERENT : RTC_INTERSECT_INCOHERENT;
+	context.userRayExt = nullptr;
+	rtcIntersect1M(current_scene->scene, &context, (RTCRay*)rays, count, sizeof(Ray));
+}
+
+void occludedStream(Ray* rays, size_t count)
+{
+	rays_traced += count;
+	if(!stream_supported)
+	{
+		for(size_t i = 0; i < count; i++)
+		{
+			rtcOccluded(current_scene->scene, *((RTCRay*)&rays[i]));
+		}
+		return;
+	}
+	RTCIntersectContext context;
+	context.flags = RTC_INTERSECT_INCOHERENT;
+	context.userRayExt = nullptr;
+	rtcOccluded1M(current_scene->scene, &context, (RTCRay*)rays, count, sizeof(Ray));
+}
+
 ///////////////////////////////////////////////////////////////////////////
 // Test whether a ray is intersected by the scene (do not return an
 // intersection).
 ///////////////////////////////////////////////////////////////////////////
 bool occluded(Ray& r)
 {
-	rtcOccluded(embree_scene, *((RTCRay*)&r));
+	rays_traced++;
+	rtcOccluded(current_scene->scene, *((RTCRay*)&r));
 	return r.geomID != RTC_INVALID_GEOMETRY_ID;
 }
+
+uint64_t takeRayCount()
+{
+	uint64_t count = rays_traced;
+	rays_traced = 0;
+	return count;
+}
 } // namespace pathtracer
\ No newline at end of file
@@ -3,7 +3,8 @@
 #include <embree2/rtcore_ray.h>
 #include "Model.h"
 #include <glm/glm.hpp>
-#include <map>
+#include <string>
+#include <vector>
 
 namespace pathtracer
 {
@@ -30,6 +31,21 @@ struct Intersection
 
 	// Material information of the hit triangle
 	const labhelper::Material* material;
+
+	// Index of the material among those of its model
+	uint32_t material_index;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// A triangle of the scene whose material emits light, in world space,
+// with the ids that a ray which hits it reports
+///////////////////////////////////////////////////////////////////////////
+struct EmissiveTriangle
+{
+	glm::vec3 positions[3];
+	glm::vec2 uvs[3];
+	const labhelper::Material* material;
+	uint32_t inst_ID, geom_ID, prim_ID;
 };
 
 ///////////////////////////////////////////////////////////////////////////
@@ -86,14 +102,48 @@ struct RTCORE_ALIGN(16) Ray
 // Scene functions
 ///////////////////////////////////////////////////////////////////////////
 
-// Add a model to the embree scene
-void addModel(const labhelper::Model* model, const glm::mat4& model_matrix);
+// Add a model to the embree scene. Its geometry is created by buildBVH(),
+// which instances models that are added more than once. Returns a handle
+// for setModelTransform(), which can only move models added as dynamic.
+uint32_t addModel(const labhelper::Model* model, const glm::mat4& model_matrix, bool dynamic = false);
+
+// Build an acceleration structure for the scene and start tracing it.
+// Returns the build time in seconds. If a name is given the scene is kept
+// for useCachedScene().
+double buildBVH(const std::string& name = "");
+
+// Build the acceleration structure on a worker thread. The current scene
+// keeps being traced until swapScene() is called after the build finished.
+void buildBVHAsync(const std::string& name);
+
+// Progress of the background build in [0, 1], or -1 if there is none
+float getBuildProgress();
 
-// Build an acceleration structure for the scene
-void buildBVH();
+// Cancel the background build, if any
+void cancelBuild();
+
+// Start tracing the scene built by buildBVHAsync(), if it has finished.
+// Must not be called while rays are being traced. Returns true on a swap.
+bool swapScene();
+
+// Start tracing a previously built scene again. Returns false if there is
+// no scene with that name.
+bool useCachedScene(const std::string& name);
+
+// Move a dynamic model. Call updateBVH() once all models have been moved.
+void setModelTransform(uint32_t handle, const glm::mat4& model_matrix);
+
+// Refit the acceleration structure to the models that moved, returns the
+// update time in seconds
+double updateBVH();
+
+// The triangles of the scene being traced whose material has an emission
+// color or texture, where they are placed now
+void getEmissiveTriangles(std::vector<EmissiveTriangle>& triangles);
 
 ///////////////////////////////////////////////////////////////////////////
-// Reinitialize the scene
+// Start describing a new scene with addModel(). The current scene is still
+// traced until the new one has been built.
 ///////////////////////////////////////////////////////////////////////////
 void reinitScene();
 
@@ -109,9 +159,30 @@ bool intersect(Ray& r);
 // Use after calling `intersect`
 Intersection getIntersection(const Ray& r);
 
+// Number of rays traced together by intersectPacket(): 16, 8 or 4, the
+// widest packet the CPU supports.
+int getPacketWidth();
+
+// Intersect getPacketWidth() rays at once. Coherent rays (e.g. the primary
+// rays of neighbouring pixels) share most of the BVH traversal this way.
+// Rays with valid[i] == false are skipped. Each valid ray gets the same hit
+// data as if intersect() had been called on it.
+void intersectPacket(Ray* rays, const bool* valid);
+
+// Intersect `count` rays (in any order) with embree's stream API. Set
+// `coherent` for rays that start close together and point the same way.
+void intersectStream(Ray* rays, size_t count, bool coherent);
+
+// Like occluded() for `count` rays. A ray is occluded if its geomID is no
+// longer RTC_INVALID_GEOMETRY_ID afterwards.
+void occludedStream(Ray* rays, size_t count);
 
 // Test whether a ray is intersected anywhere by the scene
 // (does not return an intersection, as it doesn't find the closest one)
 bool occluded(Ray& r);
 
+// Returns the number of rays (intersect() and occluded() calls) the calling
+// thread has traced since its last call to this function.
+uint64_t takeRayCount();
+
 } // namespace pathtracer
@@ -3,6 +3,8 @@
 #include <stb_image.h>
 #include <chrono>
 #include <iostream>
+#include <fstream>
+#include <cstdio>
 #include <labhelper.h>
 #include <imgui.h>
 #include <imgui_impl_sdl_gl3.h>
@@ -10,9 +12,15 @@
 #include <glm/gtx/transform.hpp>
 #include <Model.h>
 #include <string>
+#include <map>
+#include <set>
 #include "Pathtracer.h"
 #include "embree.h"
 #include "sampling.h"
+#include "LightSampler.h"
+#include "RenderThread.h"
+#include <cstring>
+#include <random>
 
 
 using namespace glm;
@@ -35,6 +43,48 @@ bool g_isMouseDragging = false;
 
 bool showLightSources = false;
 
+// Spin and bob the dynamic models of the scene
+bool animateDynamicModels = false;
+float bvhUpdateTime = 0.0f;
+// When the dynamic models were last moved by the animation
+float animatedTime = 0.0f;
+
+// Traces on a thread of its own, see update() and display()
+pathtracer::RenderThread renderThread;
+// The camera the render thread traces, and when it was handed over
+mat4 renderedViewMatrix;
+float renderedViewTime = 0.0f;
+// How long the render thread may take on a pass before a camera or model
+// change aborts it anyway, in seconds
+const float maxPassWaitTime = 0.25f;
+// Passes the render thread had completed at the last frame, and when the
+// last of them completed
+uint64_t seenPasses = 0;
+float lastPassTime = 0.0f;
+
+///////////////////////////////////////////////////////////////////////////////
+// Dynamic resolution. While the camera moves, the subsampling is chosen
+// from the speed of the last pass, so that a whole pass fits in the target
+// frame time. Optionally with direct light only.
+// When the camera stops, the subsampling is halved after every complete
+// pass until it is back at the user's setting, then the bounces are
+// restored and the image converges as usual.
+///////////////////////////////////////////////////////////////////////////////
+struct dynamic_resolution_t
+{
+	bool enabled = true;
+	bool direct_light_preview = true;
+	float target_frame_time = 33.0f; // Milliseconds
+	float max_subsampling = 32.0f;
+
+	// While previewing, the settings to go back to when the camera stops
+	bool previewing = false;
+	int still_subsampling;
+	int still_max_bounces;
+	float preview_subsampling = 8.0f;
+};
+dynamic_resolution_t dynamicResolution;
+
 ///////////////////////////////////////////////////////////////////////////////
 // Shader programs
 ///////////////////////////////////////////////////////////////////////////////
@@ -63,6 +113,9 @@ struct scene_t
 	{
 		labhelper::Model* model;
 		mat4 modelMat;
+		// Dynamic models can be moved without rebuilding the BVH
+		bool dynamic;
+		uint32_t pathtracerHandle;
 	};
 	std::vector<scene_object_t> models;
 
@@ -71,6 +124,8 @@ struct scene_t
 
 std::map<std::string, scene_t> scenes;
 std::string currentScene;
+// The scene whose BVH is being built in the background, if any
+std::string pendingScene;
 camera_t camera;
 
 int selected_model_index = 0;
@@ -78,11 +133,11 @@ int selected_mesh_index = 0;
 int selected_material_index = 0;
 
 
-void loadScenes()
+void loadScenes(bool upload_to_gpu = true)
 {
 	scenes["Sphere"] = { {
 		                     // Models
-		                     { labhelper::loadModelFromOBJ("../scenes/sphere.obj"), mat4(1.f) },
+		                     { labhelper::loadModelFromOBJ("../scenes/sphere.obj", upload_to_gpu), mat4(1.f), false, 0 },
 		                 },
 		                 {
 		                     // Camera
@@ -91,9 +146,10 @@ void loadScenes()
 		                 } };
 	scenes["Ship"] = { {
 		                   // Models
-		                   { labhelper::loadModelFromOBJ("../scenes/space-ship.obj"),
-		                     translate(vec3(0.f, 8.f, 0.f)) },
-		                   { labhelper::loadModelFromOBJ("../scenes/landingpad.obj"), mat4(1.f) },
+		                   { labhelper::loadModelFromOBJ("../scenes/space-ship.obj", upload_to_gpu),
+		                     translate(vec3(0.f, 8.f, 0.f)), false, 0 },
+		                   { labhelper::loadModelFromOBJ("../scenes/landingpad.obj", upload_to_gpu), mat4(1.f),
+		                     false, 0 },
 		               },
 		               {
 		                   // Camera
@@ -103,18 +159,43 @@ void loadScenes()
 	// Modify the landingpad screen's color
 	scenes["Ship"].models[1].model->m_materials[8].m_color = glm::vec3(0.380392, 0.588235, 0.266667);
 
+	// The Ship scene with a dynamic ship, which can be dragged or animated
+	// with BVH refits. Ship itself stays static, as it is benchmarked.
+	scenes["Moving Ship"] = scenes["Ship"];
+	scenes["Moving Ship"].models[0].dynamic = true;
+
 	scenes["Refractions"] = { {
 		                          // Models
-		                          { labhelper::loadModelFromOBJ("../scenes/refractions.obj"), mat4(1.f) },
+		                          { labhelper::loadModelFromOBJ("../scenes/refractions.obj", upload_to_gpu),
+		                            mat4(1.f), false, 0 },
 		                      },
 		                      {
 		                          // Camera
 		                          vec3(7.3, 3.2, 7.2),
 		                          normalize(vec3(-0.43, -0.27, -0.85)),
 		                      } };
+
+	// A fleet of ships hovering over a grid of landing pads. The models are
+	// shared with the Ship scene and each is placed several times, so the
+	// pathtracer builds them once and instances them.
+	scene_t& fleet = scenes["Fleet"];
+	for(int x = -1; x <= 1; x++)
+	{
+		for(int z = -1; z <= 1; z++)
+		{
+			vec3 offset(60.f * x, 0.f, 60.f * z);
+			fleet.models.push_back(
+			    { scenes["Ship"].models[0].model, translate(offset + vec3(0.f, 8.f, 0.f)), false, 0 });
+			fleet.models.push_back({ scenes["Ship"].models[1].model, translate(offset), false, 0 });
+		}
+	}
+	fleet.camera = { vec3(-110, 45, 110), normalize(-vec3(-110, 35, 110)) };
 }
 
-void changeScene(std::string sceneName)
+///////////////////////////////////////////////////////////////////////////////
+// Start rendering a scene whose BVH the pathtracer is already tracing
+///////////////////////////////////////////////////////////////////////////////
+void activateScene(std::string sceneName)
 {
 	currentScene = sceneName;
 	camera = scenes[currentScene].camera;
@@ -123,60 +204,98 @@ void changeScene(std::string sceneName)
 	selected_mesh_index = 0;
 	selected_material_index = scenes[currentScene].models[0].model->m_meshes[0].m_material_idx;
 
+	pathtracer::restart();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns the time (in seconds) it took to build the BVH. In the background
+// the old scene is rendered until the new BVH is done, see display().
+///////////////////////////////////////////////////////////////////////////////
+double changeScene(std::string sceneName, bool background = false)
+{
+	if(sceneName == pendingScene)
+	{
+		return 0.0;
+	}
+	pendingScene = "";
+	if(pathtracer::useCachedScene(sceneName))
+	{
+		activateScene(sceneName);
+		return 0.0;
+	}
 
 	pathtracer::reinitScene();
 
 	// Add models to pathtracer scene
-	for(auto& o : scenes[currentScene].models)
+	for(auto& o : scenes[sceneName].models)
+	{
+		o.pathtracerHandle = pathtracer::addModel(o.model, o.modelMat, o.dynamic);
+	}
+	if(background)
 	{
-		pathtracer::addModel(o.model, o.modelMat);
+		pathtracer::buildBVHAsync(sceneName);
+		pendingScene = sceneName;
+		return 0.0;
 	}
-	pathtracer::buildBVH();
+	double bvh_build_time = pathtracer::buildBVH(sceneName);
 
-	pathtracer::restart();
+	activateScene(sceneName);
+	return bvh_build_time;
 }
 
 void cleanupScenes()
 {
+	// Scenes may share models, so free each one only once
+	std::set<labhelper::Model*> models;
 	for(auto& it : scenes)
 	{
 		for(auto m : it.second.models)
 		{
-			labhelper::freeModel(m.model);
+			models.insert(m.model);
 		}
 	}
+	for(auto m : models)
+	{
+		labhelper::freeModel(m);
+	}
 }
 
 
 ///////////////////////////////////////////////////////////////////////////////
-// Load shaders, environment maps, models and so on
+// Path-tracer settings, light sources and environment map. Does not touch GL
+// so that it can be shared with the batch mode.
 ///////////////////////////////////////////////////////////////////////////////
-void initialize()
+void initializePathtracer()
 {
-	///////////////////////////////////////////////////////////////////////////
-	// Load shader program
-	///////////////////////////////////////////////////////////////////////////
-	shaderProgram = labhelper::loadShaderProgram("../pathtracer/copyTexture.vert",
-	                                             "../pathtracer/copyTexture.frag");
-	simpleShaderProgram = labhelper::loadShaderProgram("../pathtracer/simple.vert",
-	                                                   "../pathtracer/simple.frag");
-
-	///////////////////////////////////////////////////////////////////////////
-	// Generate result texture
-	///////////////////////////////////////////////////////////////////////////
-	glGenTextures(1, &pathtracer_result_txt_id);
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, pathtracer_result_txt_id);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-
 	///////////////////////////////////////////////////////////////////////////
 	// Initial path-tracer settings
 	///////////////////////////////////////////////////////////////////////////
 	pathtracer::settings.max_bounces = 8;
 	pathtracer::settings.max_paths_per_pixel = 0; // 0 = Infinite
+	pathtracer::settings.tile_size = 16;
+	pathtracer::settings.packet_primary_rays = true;
+	pathtracer::settings.wavefront = false;
+	pathtracer::settings.cache_primary_hits = true;
+	pathtracer::settings.jitter = false;
+	pathtracer::settings.lens_radius = 0.0f;
+	pathtracer::settings.focus_distance = 10.0f;
+	pathtracer::settings.temporal_reprojection = true;
+	pathtracer::settings.reprojection_max_samples = 16;
+	pathtracer::settings.adaptive_sampling = true;
+	pathtracer::settings.adaptive_threshold = 0.01f;
+	pathtracer::settings.adaptive_sample_budget = 0.0f;
+	pathtracer::settings.sampler = pathtracer::SOBOL_SAMPLER;
+	pathtracer::settings.denoise = false;
+	pathtracer::settings.denoise_iterations = 5;
+	pathtracer::settings.denoise_time_cap = 20.0f;
+	pathtracer::settings.statistics_aovs = false;
+	pathtracer::settings.environment_sampling = true;
+	pathtracer::settings.light_sampler = pathtracer::BVH_LIGHT_SAMPLER;
+	pathtracer::settings.light_samples = 1;
+	pathtracer::settings.emissive_lights = true;
+	pathtracer::settings.restir = false;
+	pathtracer::settings.restir_candidates = 8;
+	pathtracer::settings.restir_spatial_samples = 4;
 #ifdef _DEBUG
 	pathtracer::settings.subsampling = 16;
 #else
@@ -213,8 +332,35 @@ void initialize()
 	///////////////////////////////////////////////////////////////////////////
 	// Load environment map
 	///////////////////////////////////////////////////////////////////////////
-	pathtracer::environment.map.load("../scenes/envmaps/001.hdr");
+	pathtracer::loadEnvironment("../scenes/envmaps/001.hdr");
 	pathtracer::environment.multiplier = 1.0f;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Load shaders, environment maps, models and so on
+///////////////////////////////////////////////////////////////////////////////
+void initialize()
+{
+	///////////////////////////////////////////////////////////////////////////
+	// Load shader program
+	///////////////////////////////////////////////////////////////////////////
+	shaderProgram = labhelper::loadShaderProgram("../pathtracer/copyTexture.vert",
+	                                             "../pathtracer/copyTexture.frag");
+	simpleShaderProgram = labhelper::loadShaderProgram("../pathtracer/simple.vert",
+	                                                   "../pathtracer/simple.frag");
+
+	///////////////////////////////////////////////////////////////////////////
+	// Generate result texture
+	///////////////////////////////////////////////////////////////////////////
+	glGenTextures(1, &pathtracer_result_txt_id);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, pathtracer_result_txt_id);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+
+	initializePathtracer();
 
 	///////////////////////////////////////////////////////////////////////////
 	// Load .obj models to scene
@@ -232,8 +378,88 @@ void initialize()
 	//glEnable(GL_FRAMEBUFFER_SRGB);
 }
 
-void display(void)
+void updateDynamicResolution(bool moving, bool passCompleted)
 {
+	auto& d = dynamicResolution;
+	if(moving)
+	{
+		if(!d.previewing)
+		{
+			d.previewing = true;
+			d.still_subsampling = pathtracer::settings.subsampling;
+			d.still_max_bounces = pathtracer::settings.max_bounces;
+		}
+		else if(passCompleted && pathtracer::statistics.pass_time > 0.0)
+		{
+			// The number of pixels goes with 1 / subsampling^2. Halfway there
+			// each pass, so that a single slow pass does not make it jump.
+			const float pixelsPerMs =
+			    float(pathtracer::statistics.pass_samples) / (1000.0f * float(pathtracer::statistics.pass_time));
+			const float wanted =
+			    sqrt(float(windowWidth) * float(windowHeight) / (pixelsPerMs * d.target_frame_time));
+			d.preview_subsampling = 0.5f * (d.preview_subsampling + wanted);
+		}
+		else if(1000.0f * (currentTime - lastPassTime) > 2.0f * d.target_frame_time)
+		{
+			// Not even one pass in twice the target time
+			d.preview_subsampling *= 1.25f;
+			lastPassTime = currentTime;
+		}
+		d.preview_subsampling =
+		    glm::clamp(d.preview_subsampling, float(d.still_subsampling), d.max_subsampling);
+		pathtracer::settings.subsampling = int(d.preview_subsampling + 0.5f);
+		pathtracer::settings.max_bounces = d.direct_light_preview ? 0 : d.still_max_bounces;
+	}
+	else if(d.previewing && passCompleted)
+	{
+		if(pathtracer::settings.subsampling > d.still_subsampling)
+		{
+			pathtracer::settings.subsampling = std::max(d.still_subsampling, pathtracer::settings.subsampling / 2);
+		}
+		else
+		{
+			pathtracer::settings.max_bounces = d.still_max_bounces;
+			d.previewing = false;
+			pathtracer::restart();
+		}
+	}
+}
+
+mat4 getProjectionMatrix()
+{
+	return perspective(radians(45.0f),
+	                   float(pathtracer::rendered_image.width) / float(pathtracer::rendered_image.height),
+	                   0.1f, 100.0f);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Everything that changes the state of the pathtracer. Called while the
+// render thread is paused.
+///////////////////////////////////////////////////////////////////////////////
+void update(void)
+{
+	const uint64_t completedPasses = renderThread.getCompletedPasses();
+	const bool passCompleted = completedPasses != seenPasses;
+	seenPasses = completedPasses;
+	if(passCompleted)
+	{
+		lastPassTime = currentTime;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Lower the resolution while the camera moves
+	///////////////////////////////////////////////////////////////////////////
+	mat4 viewMatrix = lookAt(camera.position, camera.position + camera.direction, worldUp);
+	{
+		static mat4 lastViewMatrix;
+		const bool moving = viewMatrix != lastViewMatrix || animateDynamicModels;
+		lastViewMatrix = viewMatrix;
+		if(dynamicResolution.enabled || dynamicResolution.previewing)
+		{
+			updateDynamicResolution(moving && dynamicResolution.enabled, passCompleted);
+		}
+	}
+
 	{ ///////////////////////////////////////////////////////////////////////
 		// If first frame, or window resized, or subsampling changes,
 		// inform the pathtracer
@@ -251,22 +477,94 @@ void display(void)
 	}
 
 	///////////////////////////////////////////////////////////////////////////
-	// Trace one path per pixel
+	// Switch to a scene built in the background once it is done
+	///////////////////////////////////////////////////////////////////////////
+	if(pathtracer::swapScene())
+	{
+		activateScene(pendingScene);
+		pendingScene = "";
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Move the dynamic models and refit the BVH to them. Like the camera
+	// below, only once the pass with the last transforms is done, since the
+	// restart aborts it and there would be nothing to show.
 	///////////////////////////////////////////////////////////////////////////
+	if(animateDynamicModels && (passCompleted || seenPasses == 0 || currentTime - animatedTime > maxPassWaitTime))
+	{
+		animatedTime = currentTime;
+		for(auto& o : scenes[currentScene].models)
+		{
+			if(o.dynamic)
+			{
+				mat4 animation = translate(vec3(0.f, sin(currentTime), 0.f)) * o.modelMat
+				                 * rotate(0.5f * currentTime, worldUp);
+				pathtracer::setModelTransform(o.pathtracerHandle, animation);
+			}
+		}
+		bvhUpdateTime = float(pathtracer::updateBVH());
+		pathtracer::restart();
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Hand the latest camera to the render thread, which reprojects or
+	// restarts the image. While moving, only once the pass with the previous
+	// camera is done (or is taking far too long), since a new camera aborts
+	// the pass and there would be nothing to show.
+	///////////////////////////////////////////////////////////////////////////
+	if(viewMatrix != renderedViewMatrix
+	   && (passCompleted || seenPasses == 0 || currentTime - renderedViewTime > maxPassWaitTime))
+	{
+		renderedViewMatrix = viewMatrix;
+		renderedViewTime = currentTime;
+	}
+	renderThread.setCamera(renderedViewMatrix, getProjectionMatrix());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Show the last pass completed by the render thread
+///////////////////////////////////////////////////////////////////////////////
+void display(void)
+{
 	mat4 viewMatrix = lookAt(camera.position, camera.position + camera.direction, worldUp);
-	mat4 projMatrix = perspective(radians(45.0f),
-	                              float(pathtracer::rendered_image.width)
-	                                  / float(pathtracer::rendered_image.height),
-	                              0.1f, 100.0f);
-	pathtracer::tracePaths(viewMatrix, projMatrix);
+	mat4 projMatrix = getProjectionMatrix();
 
 	///////////////////////////////////////////////////////////////////////////
-	// Copy pathtraced image to texture for display
+	// Copy pathtraced image to texture for display. The pixels go through a
+	// pixel buffer object that is only reallocated when the image size
+	// changes, and the texture is updated in place.
 	///////////////////////////////////////////////////////////////////////////
+	static GLuint pixelBuffer = 0;
+	static int textureWidth = 0, textureHeight = 0;
+	static uint64_t snapshotVersion = 0;
 	glActiveTexture(GL_TEXTURE0);
 	glBindTexture(GL_TEXTURE_2D, pathtracer_result_txt_id);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, pathtracer::rendered_image.width,
-	             pathtracer::rendered_image.height, 0, GL_RGB, GL_FLOAT, pathtracer::rendered_image.getPtr());
+	renderThread.readSnapshot(snapshotVersion, [&](const pathtracer::RenderThread::Snapshot& snapshot) {
+		const GLsizeiptr size = GLsizeiptr(snapshot.data.size() * sizeof(vec3));
+		if(pixelBuffer == 0)
+		{
+			glGenBuffers(1, &pixelBuffer);
+		}
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pixelBuffer);
+		if(snapshot.width != textureWidth || snapshot.height != textureHeight)
+		{
+			textureWidth = snapshot.width;
+			textureHeight = snapshot.height;
+			glBufferData(GL_PIXEL_UNPACK_BUFFER, size, nullptr, GL_STREAM_DRAW);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, textureWidth, textureHeight, 0, GL_RGB, GL_FLOAT, nullptr);
+		}
+		// Invalidating lets the driver hand out fresh memory instead of
+		// waiting for the previous upload to finish
+		void* pixels =
+		    glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+		if(pixels)
+		{
+			memcpy(pixels, snapshot.data.data(), size);
+			glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, textureWidth, textureHeight, GL_RGB, GL_FLOAT, nullptr);
+		}
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	});
 
 	///////////////////////////////////////////////////////////////////////////
 	// Render a fullscreen quad, textured with our pathtraced image.
@@ -365,7 +663,6 @@ bool handleEvents(void)
 			camera.direction = vec3(pitch * yaw * vec4(camera.direction, 0.0f));
 			g_prevMouseCoords.x = event.motion.x;
 			g_prevMouseCoords.y = event.motion.y;
-			pathtracer::restart();
 		}
 	}
 
@@ -378,32 +675,26 @@ bool handleEvents(void)
 		if(state[SDL_SCANCODE_W])
 		{
 			camera.position += deltaTime * speed * camera.direction;
-			pathtracer::restart();
 		}
 		if(state[SDL_SCANCODE_S])
 		{
 			camera.position -= deltaTime * speed * camera.direction;
-			pathtracer::restart();
 		}
 		if(state[SDL_SCANCODE_A])
 		{
 			camera.position -= deltaTime * speed * cameraRight;
-			pathtracer::restart();
 		}
 		if(state[SDL_SCANCODE_D])
 		{
 			camera.position += deltaTime * speed * cameraRight;
-			pathtracer::restart();
 		}
 		if(state[SDL_SCANCODE_Q])
 		{
 			camera.position -= deltaTime * speed * worldUp;
-			pathtracer::restart();
 		}
 		if(state[SDL_SCANCODE_E])
 		{
 			camera.position += deltaTime * speed * worldUp;
-			pathtracer::restart();
 		}
 	}
 
@@ -420,7 +711,7 @@ void gui()
 			{
 				if(ImGui::MenuItem(it.first.c_str(), nullptr, it.first == currentScene))
 				{
-					changeScene(it.first);
+					changeScene(it.first, true);
 				}
 			}
 			ImGui::EndMenu();
@@ -428,6 +719,21 @@ void gui()
 		ImGui::EndMainMenuBar();
 	}
 
+	const float build_progress = pathtracer::getBuildProgress();
+	if(build_progress >= 0.0f)
+	{
+		ImGui::SetNextWindowPos(ImVec2(10, 30));
+		ImGui::Begin("Building BVH", nullptr, ImGuiWindowFlags_AlwaysAutoResize | ImGuiWindowFlags_NoTitleBar);
+		ImGui::Text("Building %s...", pendingScene.c_str());
+		ImGui::ProgressBar(build_progress, ImVec2(200, 0));
+		if(ImGui::Button("Cancel"))
+		{
+			pathtracer::cancelBuild();
+			pendingScene = "";
+		}
+		ImGui::End();
+	}
+
 	///////////////////////////////////////////////////////////////////////////
 	// Helpers for getting lists of materials and meshes into widgets
 	///////////////////////////////////////////////////////////////////////////
@@ -476,11 +782,78 @@ void gui()
 		ImGui::SliderInt("Subsampling", &pathtracer::settings.subsampling, 1, 16);
 		ImGui::SliderInt("Max Bounces", &pathtracer::settings.max_bounces, 0, 16);
 		ImGui::SliderInt("Max Paths Per Pixel", &pathtracer::settings.max_paths_per_pixel, 0, 1024);
+		ImGui::SliderInt("Tile Size", &pathtracer::settings.tile_size, 4, 64);
+		ImGui::Checkbox("Dynamic Resolution", &dynamicResolution.enabled);
+		if(dynamicResolution.enabled)
+		{
+			ImGui::SliderFloat("Target Frame Time (ms)", &dynamicResolution.target_frame_time, 5.0f, 100.0f);
+			ImGui::Checkbox("Direct Light Preview", &dynamicResolution.direct_light_preview);
+		}
+		ImGui::Checkbox("Packet Primary Rays", &pathtracer::settings.packet_primary_rays);
+		ImGui::Checkbox("Wavefront Integrator", &pathtracer::settings.wavefront);
+		ImGui::Checkbox("Cache Primary Hits", &pathtracer::settings.cache_primary_hits);
+		if(ImGui::Combo("Sampler", &pathtracer::settings.sampler, pathtracer::sampler_names,
+		                pathtracer::NUM_SAMPLER_TYPES))
+		{
+			pathtracer::restart();
+		}
+		if(ImGui::Checkbox("Jitter (Anti-aliasing)", &pathtracer::settings.jitter))
+		{
+			pathtracer::restart();
+		}
+		if(ImGui::SliderFloat("Lens Radius", &pathtracer::settings.lens_radius, 0.0f, 2.0f))
+		{
+			pathtracer::restart();
+		}
+		if(ImGui::SliderFloat("Focus Distance", &pathtracer::settings.focus_distance, 0.1f, 200.0f, "%.3f", 2.0f))
+		{
+			pathtracer::restart();
+		}
+		ImGui::Checkbox("Temporal Reprojection", &pathtracer::settings.temporal_reprojection);
+		if(pathtracer::settings.temporal_reprojection)
+		{
+			ImGui::SliderInt("Max Reprojected Samples", &pathtracer::settings.reprojection_max_samples, 1, 256);
+		}
+		ImGui::Checkbox("Adaptive Sampling", &pathtracer::settings.adaptive_sampling);
+		if(pathtracer::settings.adaptive_sampling)
+		{
+			ImGui::SliderFloat("Error Threshold", &pathtracer::settings.adaptive_threshold, 0.001f, 0.2f, "%.4f", 3.0f);
+			ImGui::SliderFloat("Sample Budget (spp)", &pathtracer::settings.adaptive_sample_budget, 0.0f, 4096.0f,
+			                   "%.0f", 3.0f);
+			ImGui::Text("Image error: %.4f, converged tiles: %.0f%%", pathtracer::statistics.image_error,
+			            100.0f * pathtracer::statistics.converged_tiles);
+		}
+		ImGui::Checkbox("Denoise", &pathtracer::settings.denoise);
+		if(pathtracer::settings.denoise)
+		{
+			ImGui::SliderInt("Denoise Iterations", &pathtracer::settings.denoise_iterations, 1, 8);
+			ImGui::SliderFloat("Denoise Time Cap (ms)", &pathtracer::settings.denoise_time_cap, 0.0f, 100.0f);
+		}
+		ImGui::Checkbox("Statistics AOVs", &pathtracer::settings.statistics_aovs);
+		if(ImGui::Button("Save AOVs"))
+		{
+			for(int i = 0; i < pathtracer::NUM_AOV_TYPES; i++)
+			{
+				pathtracer::saveAOV(std::string("aov_") + pathtracer::aov_names[i], i);
+			}
+		}
 		if(ImGui::Button("Restart Pathtracing"))
 		{
 			pathtracer::restart();
 		}
 		ImGui::Text("Num. samples: %d", pathtracer::getSampleCount());
+		const auto& utilization = pathtracer::statistics.thread_utilization;
+		if(!utilization.empty())
+		{
+			float min_utilization = 1.0f, sum_utilization = 0.0f;
+			for(float u : utilization)
+			{
+				min_utilization = std::min(min_utilization, u);
+				sum_utilization += u;
+			}
+			ImGui::Text("Thread utilization: %.0f%% avg, %.0f%% min", 100.0f * sum_utilization / utilization.size(),
+			            100.0f * min_utilization);
+		}
 	}
 
 	///////////////////////////////////////////////////////////////////////////
@@ -499,6 +872,19 @@ void gui()
 			selected_material_index = selected_model->m_meshes[selected_mesh_index].m_material_idx;
 		}
 
+		auto& selected_object = selected_scene->models[selected_model_index];
+		if(selected_object.dynamic)
+		{
+			if(ImGui::DragFloat3("Model Position", &selected_object.modelMat[3].x, 0.1f))
+			{
+				pathtracer::setModelTransform(selected_object.pathtracerHandle, selected_object.modelMat);
+				bvhUpdateTime = float(pathtracer::updateBVH());
+				pathtracer::restart();
+			}
+		}
+		ImGui::Checkbox("Animate dynamic models", &animateDynamicModels);
+		ImGui::Text("BVH refit: %.2f ms", 1000.0f * bvhUpdateTime);
+
 		///////////////////////////////////////////////////////////////////////////
 		// List all meshes in the model and show properties for the selected
 		///////////////////////////////////////////////////////////////////////////
@@ -548,6 +934,18 @@ void gui()
 	{
 		ImGui::Checkbox("Show Light Overlays", &showLightSources);
 		ImGui::SliderFloat("Environment multiplier", &pathtracer::environment.multiplier, 0.0f, 10.0f);
+		ImGui::Checkbox("Importance Sample Environment", &pathtracer::settings.environment_sampling);
+		ImGui::Combo("Light Sampler", &pathtracer::settings.light_sampler, pathtracer::light_sampler_names,
+		             pathtracer::NUM_LIGHT_SAMPLER_TYPES);
+		ImGui::SliderInt("Light Samples", &pathtracer::settings.light_samples, 1, 8);
+		ImGui::Checkbox("Sample Emissive Triangles", &pathtracer::settings.emissive_lights);
+		ImGui::Checkbox("ReSTIR Direct Lighting", &pathtracer::settings.restir);
+		if(pathtracer::settings.restir)
+		{
+			ImGui::SliderInt("ReSTIR Candidates", &pathtracer::settings.restir_candidates, 1, 32);
+			ImGui::SliderInt("ReSTIR Spatial Samples", &pathtracer::settings.restir_spatial_samples, 0,
+			                 pathtracer::RESTIR_MAX_SPATIAL_SAMPLES);
+		}
 		ImGui::Separator();
 		ImGui::Text("Point Light");
 		ImGui::ColorEdit3("Point light color", &pathtracer::point_light.color.x);
@@ -580,11 +978,464 @@ void gui()
 	ImGui::End(); // Control Panel
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// Batch mode. Renders a scene without opening a window, saves the image and
+// writes a JSON report with timings, e.g.:
+//   pathtracer --batch --scene Ship --width 1280 --height 720 --spp 256
+//              --threads 16 --output ship --report ship.json
+// To compare samplers, render a reference with many samples and pass it as
+// --reference to renders with each --sampler: the report then has the RMS
+// error of every pass, i.e. the error versus samples per pixel.
+///////////////////////////////////////////////////////////////////////////////
+struct batch_options_t
+{
+	std::string scene = "Ship";
+	bool override_camera = false;
+	camera_t camera;
+	int width = 1280;
+	int height = 720;
+	int spp = 64;
+	int threads = 0; // 0 = OpenMP default
+	int max_bounces = 8;
+	int tile_size = 16;
+	bool packets = true;
+	bool wavefront = false;
+	bool jitter = true;
+	float lens_radius = 0.0f;
+	float focus_distance = 10.0f;
+	float adaptive_threshold = 0.0f; // 0 = sample every pixel spp times
+	int sampler = pathtracer::RANDOM_SAMPLER;
+	std::string reference; // HDR image to measure the error of every pass against
+	bool denoise = false;
+	bool aovs = false;
+	bool environment_sampling = true;
+	int light_sampler = pathtracer::BVH_LIGHT_SAMPLER;
+	int light_samples = 1;
+	int disc_lights = 0; // Random disc lights added to the scene
+	bool emissive_lights = true;
+	bool restir = false;
+	int restir_candidates = 8;
+	int restir_spatial_samples = 4;
+	std::string output = "render";
+	std::string report = "render.json";
+};
+
+void printBatchUsage()
+{
+	cout << "Usage: pathtracer --batch [options]\n"
+	     << "  --scene <name>                  Sphere, Ship, \"Moving Ship\", Fleet or Refractions (default Ship)\n"
+	     << "  --camera px,py,pz,dx,dy,dz      Camera position and direction (default from scene)\n"
+	     << "  --width <w> --height <h>        Image resolution (default 1280x720)\n"
+	     << "  --spp <n>                       Samples per pixel (default 64)\n"
+	     << "  --bounces <n>                   Max bounces (default 8)\n"
+	     << "  --threads <n>                   Number of render threads (default all)\n"
+	     << "  --tile-size <n>                 Tile width and height in pixels (default 16)\n"
+	     << "  --packets <0|1>                 Trace primary rays in packets (default 1)\n"
+	     << "  --wavefront <0|1>               Use the wavefront integrator (default 0)\n"
+	     << "  --jitter <0|1>                  Jitter sub-pixel positions (default 1)\n"
+	     << "  --lens radius,focus             Thin lens depth of field (default pinhole)\n"
+	     << "  --adaptive <error>              Stop sampling tiles below this relative error,\n"
+	     << "                                  spp is then the average budget (default 0, off)\n"
+	     << "  --sampler <name>                random, sobol, halton or bluenoise (default random)\n"
+	     << "  --reference <file.hdr>          Report the RMS error of every pass against this image\n"
+	     << "  --denoise <0|1>                 Also write a denoised <file>_denoised (default 0)\n"
+	     << "  --aovs <0|1>                    Also write the AOVs, as <file>_albedo etc. (default 0)\n"
+	     << "  --env-sampling <0|1>            Importance sample the environment map (default 1)\n"
+	     << "  --light-sampler <name>          power or bvh, picks the light to sample (default bvh)\n"
+	     << "  --light-samples <n>             Lights sampled per bounce (default 1)\n"
+	     << "  --disc-lights <n>               Add n random disc lights, for many light tests (default 0)\n"
+	     << "  --emissive-lights <0|1>         Sample emissive triangles as lights, with MIS (default 1)\n"
+	     << "  --restir <0|1>                  Resample the direct lighting of primary hits (default 0)\n"
+	     << "  --restir-candidates <n>         Lights sampled per pixel and pass by ReSTIR (default 8)\n"
+	     << "  --restir-spatial <n>            Neighbouring reservoirs reused, 0 to 8 (default 4)\n"
+	     << "  --output <file>                 Writes <file>.hdr and <file>.png (default render)\n"
+	     << "  --report <file>                 JSON timing report (default render.json)\n";
+}
+
+bool parseBatchOptions(int argc, char* argv[], batch_options_t& options)
+{
+	for(int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if(arg == "--batch")
+		{
+			continue;
+		}
+		if(i + 1 >= argc)
+		{
+			cout << "Missing value for " << arg << "\n";
+			return false;
+		}
+		const char* value = argv[++i];
+		if(arg == "--scene")
+			options.scene = value;
+		else if(arg == "--width")
+			options.width = atoi(value);
+		else if(arg == "--height")
+			options.height = atoi(value);
+		else if(arg == "--spp")
+			options.spp = atoi(value);
+		else if(arg == "--bounces")
+			options.max_bounces = atoi(value);
+		else if(arg == "--threads")
+			options.threads = atoi(value);
+		else if(arg == "--tile-size")
+			options.tile_size = atoi(value);
+		else if(arg == "--packets")
+			options.packets = atoi(value) != 0;
+		else if(arg == "--wavefront")
+			options.wavefront = atoi(value) != 0;
+		else if(arg == "--jitter")
+			options.jitter = atoi(value) != 0;
+		else if(arg == "--lens")
+		{
+			if(sscanf(value, "%f,%f", &options.lens_radius, &options.focus_distance) != 2)
+			{
+				cout << "Expected --lens radius,focus\n";
+				return false;
+			}
+		}
+		else if(arg == "--adaptive")
+			options.adaptive_threshold = float(atof(value));
+		else if(arg == "--sampler")
+		{
+			const char* names[] = { "random", "sobol", "halton", "bluenoise" };
+			options.sampler = -1;
+			for(int s = 0; s < pathtracer::NUM_SAMPLER_TYPES; s++)
+			{
+				if(std::string(value) == names[s])
+				{
+					options.sampler = s;
+				}
+			}
+			if(options.sampler < 0)
+			{
+				cout << "Unknown sampler " << value << "\n";
+				return false;
+			}
+		}
+		else if(arg == "--reference")
+			options.reference = value;
+		else if(arg == "--denoise")
+			options.denoise = atoi(value) != 0;
+		else if(arg == "--aovs")
+			options.aovs = atoi(value) != 0;
+		else if(arg == "--env-sampling")
+			options.environment_sampling = atoi(value) != 0;
+		else if(arg == "--light-sampler")
+		{
+			const char* names[] = { "power", "bvh" };
+			options.light_sampler = -1;
+			for(int s = 0; s < pathtracer::NUM_LIGHT_SAMPLER_TYPES; s++)
+			{
+				if(std::string(value) == names[s])
+				{
+					options.light_sampler = s;
+				}
+			}
+			if(options.light_sampler < 0)
+			{
+				cout << "Unknown light sampler " << value << "\n";
+				return false;
+			}
+		}
+		else if(arg == "--light-samples")
+			options.light_samples = std::max(1, atoi(value));
+		else if(arg == "--disc-lights")
+			options.disc_lights = atoi(value);
+		else if(arg == "--emissive-lights")
+			options.emissive_lights = atoi(value) != 0;
+		else if(arg == "--restir")
+			options.restir = atoi(value) != 0;
+		else if(arg == "--restir-candidates")
+			options.restir_candidates = std::max(1, atoi(value));
+		else if(arg == "--restir-spatial")
+			options.restir_spatial_samples =
+			    std::min(std::max(0, atoi(value)), pathtracer::RESTIR_MAX_SPATIAL_SAMPLES);
+		else if(arg == "--output")
+			options.output = value;
+		else if(arg == "--report")
+			options.report = value;
+		else if(arg == "--camera")
+		{
+			vec3& p = options.camera.position;
+			vec3& d = options.camera.direction;
+			if(sscanf(value, "%f,%f,%f,%f,%f,%f", &p.x, &p.y, &p.z, &d.x, &d.y, &d.z) != 6)
+			{
+				cout << "Expected --camera px,py,pz,dx,dy,dz\n";
+				return false;
+			}
+			d = normalize(d);
+			options.override_camera = true;
+		}
+		else
+		{
+			cout << "Unknown option " << arg << "\n";
+			return false;
+		}
+	}
+	if(options.width <= 0 || options.height <= 0 || options.spp <= 0 || options.tile_size <= 0)
+	{
+		cout << "Width, height, spp and tile size must be positive\n";
+		return false;
+	}
+	return true;
+}
+
+int runBatch(const batch_options_t& options)
+{
+	auto start_time = std::chrono::steady_clock::now();
+	if(options.threads > 0)
+	{
+		omp_set_num_threads(options.threads);
+	}
+
+	initializePathtracer();
+	pathtracer::settings.subsampling = 1;
+	pathtracer::settings.max_bounces = options.max_bounces;
+	pathtracer::settings.max_paths_per_pixel = 0;
+	pathtracer::settings.tile_size = options.tile_size;
+	pathtracer::settings.packet_primary_rays = options.packets;
+	pathtracer::settings.wavefront = options.wavefront;
+	pathtracer::settings.jitter = options.jitter;
+	pathtracer::settings.lens_radius = options.lens_radius;
+	pathtracer::settings.focus_distance = options.focus_distance;
+	pathtracer::settings.temporal_reprojection = false;
+	pathtracer::settings.adaptive_sampling = options.adaptive_threshold > 0.0f;
+	pathtracer::settings.adaptive_threshold = options.adaptive_threshold;
+	pathtracer::settings.adaptive_sample_budget = float(options.spp);
+	pathtracer::settings.sampler = options.sampler;
+	pathtracer::settings.statistics_aovs = options.aovs;
+	pathtracer::settings.environment_sampling = options.environment_sampling;
+	pathtracer::settings.light_sampler = options.light_sampler;
+	pathtracer::settings.light_samples = options.light_samples;
+	pathtracer::settings.emissive_lights = options.emissive_lights;
+	pathtracer::settings.restir = options.restir;
+	pathtracer::settings.restir_candidates = options.restir_candidates;
+	pathtracer::settings.restir_spatial_samples = options.restir_spatial_samples;
+
+	///////////////////////////////////////////////////////////////////////////
+	// The reference image is stored top row first, like saveImage() writes
+	///////////////////////////////////////////////////////////////////////////
+	std::vector<vec3> reference;
+	if(!options.reference.empty())
+	{
+		int w, h, channels;
+		float* data = stbi_loadf(options.reference.c_str(), &w, &h, &channels, 3);
+		if(data == nullptr || w != options.width || h != options.height)
+		{
+			cout << "Failed to load a " << options.width << "x" << options.height
+			     << " reference image: " << options.reference << "\n";
+			stbi_image_free(data);
+			return 1;
+		}
+		reference.resize(w * h);
+		for(int y = 0; y < h; y++)
+		{
+			for(int x = 0; x < w; x++)
+			{
+				const float* c = &data[((h - 1 - y) * w + x) * 3];
+				reference[y * w + x] = vec3(c[0], c[1], c[2]);
+			}
+		}
+		stbi_image_free(data);
+	}
+
+	loadScenes(false);
+	if(scenes.find(options.scene) == scenes.end())
+	{
+		cout << "Unknown scene " << options.scene << "\n";
+		cleanupScenes();
+		return 1;
+	}
+	const double bvh_build_time = changeScene(options.scene);
+	if(options.override_camera)
+	{
+		camera = options.camera;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Small disc lights above the scene, facing roughly down. Together they
+	// are about as bright as the point light.
+	///////////////////////////////////////////////////////////////////////////
+	std::minstd_rand random_lights(1);
+	std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+	for(int i = 0; i < options.disc_lights; i++)
+	{
+		auto random = [&]() { return uniform(random_lights); };
+		const vec3 position = vec3(40.0f * random() - 20.0f, 2.0f + 23.0f * random(), 40.0f * random() - 20.0f);
+		const vec3 target = vec3(10.0f * random() - 5.0f, 0.0f, 10.0f * random() - 5.0f);
+		const vec3 color = vec3(0.5f) + 0.5f * vec3(random(), random(), random());
+		pathtracer::disc_lights.push_back(pathtracer::DiscLight{ 2500.0f / float(options.disc_lights), color,
+		                                                         position, normalize(target - position), 0.5f });
+	}
+	pathtracer::resize(options.width, options.height);
+
+	mat4 viewMatrix = lookAt(camera.position, camera.position + camera.direction, worldUp);
+	mat4 projMatrix = perspective(radians(45.0f), float(options.width) / float(options.height), 0.1f, 100.0f);
+
+	std::vector<pathtracer::Statistics> passes;
+	std::vector<double> pass_errors;
+	double render_time = 0.0;
+	uint64_t total_rays = 0, total_samples = 0;
+	std::vector<double> thread_busy_time;
+	// Adaptive sampling takes as many passes as it needs to spend the budget
+	const bool adaptive = pathtracer::settings.adaptive_sampling;
+	for(int pass = 0; (adaptive || pass < options.spp) && !pathtracer::isRenderingDone(); pass++)
+	{
+		pathtracer::tracePaths(viewMatrix, projMatrix);
+		passes.push_back(pathtracer::statistics);
+		if(!reference.empty())
+		{
+			double squared_error = 0.0;
+			for(size_t i = 0; i < reference.size(); i++)
+			{
+				const vec3 d = pathtracer::rendered_image.data[i] - reference[i];
+				squared_error += dot(d, d) / 3.0f;
+			}
+			pass_errors.push_back(sqrt(squared_error / double(reference.size())));
+		}
+		render_time += pathtracer::statistics.pass_time;
+		total_rays += pathtracer::statistics.pass_rays;
+		total_samples += pathtracer::statistics.pass_samples;
+		const auto& utilization = pathtracer::statistics.thread_utilization;
+		thread_busy_time.resize(std::max(thread_busy_time.size(), utilization.size()), 0.0);
+		for(size_t i = 0; i < utilization.size(); i++)
+		{
+			thread_busy_time[i] += utilization[i] * pathtracer::statistics.pass_time;
+		}
+		if(adaptive)
+		{
+			cout << "\rPass " << pass + 1 << ", error " << pathtracer::statistics.image_error << flush;
+		}
+		else
+		{
+			cout << "\rPass " << pass + 1 << "/" << options.spp << flush;
+		}
+	}
+	cout << "\n";
+
+	///////////////////////////////////////////////////////////////////////////
+	// Primary ray throughput, one ray at a time and in packets. Best of a
+	// few runs, so that the first (cold cache) run does not count.
+	///////////////////////////////////////////////////////////////////////////
+	double scalar_rays_per_second = 0.0, packet_rays_per_second = 0.0;
+	for(int i = 0; i < 3; i++)
+	{
+		scalar_rays_per_second =
+		    std::max(scalar_rays_per_second, pathtracer::benchmarkPrimaryRays(viewMatrix, projMatrix, false));
+		packet_rays_per_second =
+		    std::max(packet_rays_per_second, pathtracer::benchmarkPrimaryRays(viewMatrix, projMatrix, true));
+	}
+
+	bool saved = pathtracer::saveImage(options.output);
+	double denoise_time = 0.0;
+	if(options.denoise)
+	{
+		// Including writing the files
+		const double denoise_start = omp_get_wtime();
+		saved = pathtracer::saveImage(options.output + "_denoised", true) && saved;
+		denoise_time = omp_get_wtime() - denoise_start;
+	}
+	if(options.aovs)
+	{
+		for(int i = 0; i < pathtracer::NUM_AOV_TYPES; i++)
+		{
+			saved = pathtracer::saveAOV(options.output + "_" + pathtracer::aov_names[i], i) && saved;
+		}
+	}
+	cleanupScenes();
+	std::chrono::duration<double> wall_time = std::chrono::steady_clock::now() - start_time;
+	if(!saved)
+	{
+		return 1;
+	}
+
+	std::ofstream report(options.report);
+	if(!report)
+	{
+		cout << "Failed to write report: " << options.report << "\n";
+		return 1;
+	}
+	report << "{\n"
+	       << "  \"scene\": \"" << options.scene << "\",\n"
+	       << "  \"width\": " << options.width << ",\n"
+	       << "  \"height\": " << options.height << ",\n"
+	       << "  \"spp\": " << options.spp << ",\n"
+	       << "  \"max_bounces\": " << options.max_bounces << ",\n"
+	       << "  \"threads\": " << omp_get_max_threads() << ",\n"
+	       << "  \"tile_size\": " << options.tile_size << ",\n"
+	       << "  \"bvh_build_time\": " << bvh_build_time << ",\n"
+	       << "  \"render_time\": " << render_time << ",\n"
+	       << "  \"denoise_time\": " << denoise_time << ",\n"
+	       << "  \"wall_time\": " << wall_time.count() << ",\n"
+	       << "  \"samples_per_second\": " << total_samples / render_time << ",\n"
+	       << "  \"rays_per_second\": " << total_rays / render_time << ",\n"
+	       << "  \"packets\": " << (options.packets ? "true" : "false") << ",\n"
+	       << "  \"wavefront\": " << (options.wavefront ? "true" : "false") << ",\n"
+	       << "  \"adaptive_threshold\": " << options.adaptive_threshold << ",\n"
+	       << "  \"sampler\": \"" << pathtracer::sampler_names[options.sampler] << "\",\n"
+	       << "  \"environment_sampling\": " << (options.environment_sampling ? "true" : "false") << ",\n"
+	       << "  \"light_sampler\": \"" << pathtracer::light_sampler_names[options.light_sampler] << "\",\n"
+	       << "  \"light_samples\": " << options.light_samples << ",\n"
+	       << "  \"disc_lights\": " << options.disc_lights << ",\n"
+	       << "  \"emissive_lights\": " << (options.emissive_lights ? "true" : "false") << ",\n"
+	       << "  \"restir\": " << (options.restir ? "true" : "false") << ",\n"
+	       << "  \"restir_candidates\": " << options.restir_candidates << ",\n"
+	       << "  \"restir_spatial_samples\": " << options.restir_spatial_samples << ",\n"
+	       << "  \"image_error\": " << pathtracer::statistics.image_error << ",\n"
+	       << "  \"converged_tiles\": " << pathtracer::statistics.converged_tiles << ",\n"
+	       << "  \"packet_width\": " << pathtracer::getPacketWidth() << ",\n"
+	       << "  \"primary_mrays_per_second\": { \"single\": " << scalar_rays_per_second / 1e6
+	       << ", \"packet\": " << packet_rays_per_second / 1e6 << " },\n"
+	       << "  \"thread_utilization\": [";
+	for(size_t i = 0; i < thread_busy_time.size(); i++)
+	{
+		report << (i > 0 ? ", " : "") << thread_busy_time[i] / render_time;
+	}
+	report << "],\n"
+	       << "  \"passes\": [\n";
+	for(size_t i = 0; i < passes.size(); i++)
+	{
+		report << "    { \"time\": " << passes[i].pass_time << ", \"rays\": " << passes[i].pass_rays
+		       << ", \"samples\": " << passes[i].pass_samples;
+		if(i < pass_errors.size())
+		{
+			report << ", \"rms_error\": " << pass_errors[i];
+		}
+		report << " }" << (i + 1 < passes.size() ? ",\n" : "\n");
+	}
+	report << "  ]\n"
+	       << "}\n";
+
+	cout << "Rendered " << options.scene << " in " << render_time << " s ("
+	     << total_samples / render_time / 1e6 << " Msamples/s, " << total_rays / render_time / 1e6
+	     << " Mrays/s)\n";
+	cout << "Primary rays: " << scalar_rays_per_second / 1e6 << " Mrays/s single, " << packet_rays_per_second / 1e6
+	     << " Mrays/s in packets of " << pathtracer::getPacketWidth() << "\n";
+	return 0;
+}
+
 int main(int argc, char* argv[])
 {
+	for(int i = 1; i < argc; i++)
+	{
+		if(std::string(argv[i]) == "--batch")
+		{
+			batch_options_t options;
+			if(!parseBatchOptions(argc, argv, options))
+			{
+				printBatchUsage();
+				return 1;
+			}
+			return runBatch(options);
+		}
+	}
+
 	g_window = labhelper::init_window_SDL("Pathtracer", 1280, 720);
 
 	initialize();
+	renderThread.start();
 
 	bool stopRendering = false;
 	auto startTime = std::chrono::system_clock::now();
@@ -599,18 +1450,25 @@ int main(int argc, char* argv[])
 		// Inform imgui of new frame
 		ImGui_ImplSdlGL3_NewFrame(g_window);
 
-		// check events (keyboard among other)
-		stopRendering = handleEvents();
+		{
+			// The pathtracer may only be changed while the render thread is paused
+			auto paused = renderThread.pause();
 
-		// render to window
-		display();
+			// check events (keyboard among other)
+			stopRendering = handleEvents();
 
-		// Then render overlay GUI.
-		if(showUI)
-		{
-			gui();
+			update();
+
+			// Then build the overlay GUI.
+			if(showUI)
+			{
+				gui();
+			}
 		}
 
+		// render to window
+		display();
+
 		// Render the GUI.
 		ImGui::Render();
 
@@ -618,6 +1476,10 @@ int main(int argc, char* argv[])
 		SDL_GL_SwapWindow(g_window);
 	}
 
+	// The render and BVH builder threads may still be reading the models
+	renderThread.stop();
+	pathtracer::cancelBuild();
+
 	// Delete Models
 	cleanupScenes();
 
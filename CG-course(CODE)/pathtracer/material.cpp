@@ -36,6 +36,11 @@ WiSample Diffuse::sample_wi(const vec3& wo, const vec3& n) const
 	return r;
 }
 
+float Diffuse::pdf(const vec3& wi, const vec3& wo, const vec3& n) const
+{
+	return max(0.0f, dot(wi, n)) / M_PI;
+}
+
 vec3 MicrofacetBRDF::f(const vec3& wi, const vec3& wo, const vec3& n) const
 {
 	return vec3(0.0f);
@@ -158,6 +163,11 @@ WiSample GlassBTDF::sample_wi(const vec3& wo, const vec3& n) const
 	return r;
 }
 
+float GlassBTDF::pdf(const vec3& wi, const vec3& wo, const vec3& n) const
+{
+	return 0.0f;
+}
+
 vec3 BTDFLinearBlend::f(const vec3& wi, const vec3& wo, const vec3& n) const
 {
 	return w * btdf0->f(wi, wo, n) + (1.0f - w) * btdf1->f(wi, wo, n);
@@ -177,5 +187,10 @@ WiSample BTDFLinearBlend::sample_wi(const vec3& wo, const vec3& n) const
 	}
 }
 
+float BTDFLinearBlend::pdf(const vec3& wi, const vec3& wo, const vec3& n) const
+{
+	return w * btdf0->pdf(wi, wo, n) + (1.0f - w) * btdf1->pdf(wi, wo, n);
+}
+
 #endif
 } // namespace pathtracer
@@ -39,6 +39,10 @@ public:
 	// Sample a suitable direction and return the btdf in that direction as
 	// well as the pdf (~probability) that the direction was chosen.
 	virtual WiSample sample_wi(const vec3& wo, const vec3& n) const = 0;
+
+	// The pdf that sample_wi() chooses wi with. 0 if it only ever chooses
+	// one direction (a perfect mirror or refraction).
+	virtual float pdf(const vec3& wi, const vec3& wo, const vec3& n) const = 0;
 };
 
 
@@ -79,6 +83,7 @@ public:
 	}
 	virtual vec3 f(const vec3& wi, const vec3& wo, const vec3& n) const override;
 	virtual WiSample sample_wi(const vec3& wo, const vec3& n) const override;
+	virtual float pdf(const vec3& wi, const vec3& wo, const vec3& n) const override;
 };
 
 
@@ -172,6 +177,7 @@ public:
 
 	virtual vec3 f(const vec3& wi, const vec3& wo, const vec3& n) const override;
 	virtual WiSample sample_wi(const vec3& wo, const vec3& n) const override;
+	virtual float pdf(const vec3& wi, const vec3& wo, const vec3& n) const override;
 };
 
 class BTDFLinearBlend : public BTDF
@@ -188,6 +194,7 @@ public:
 	virtual vec3 f(const vec3& wi, const vec3& wo, const vec3& n) const override;
 
 	virtual WiSample sample_wi(const vec3& wo, const vec3& n) const override;
+	virtual float pdf(const vec3& wi, const vec3& wo, const vec3& n) const override;
 };
 #endif
 
@@ -1,35 +1,335 @@
 #include "sampling.h"
-#include <random>
 #include "labhelper.h"
-#include <omp.h>
 #include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cmath>
 #include <glm/glm.hpp>
 
 using namespace glm;
 
 namespace pathtracer
 {
+const char* sampler_names[NUM_SAMPLER_TYPES] = { "Random", "Sobol (Owen scrambled)", "Halton", "Blue Noise" };
+
+static float toUnitFloat(uint32_t bits)
+{
+	return float(bits >> 8) * (1.0f / 16777216.0f);
+}
+
+static uint32_t reverseBits(uint32_t v)
+{
+	v = ((v >> 1) & 0x55555555) | ((v & 0x55555555) << 1);
+	v = ((v >> 2) & 0x33333333) | ((v & 0x33333333) << 2);
+	v = ((v >> 4) & 0x0F0F0F0F) | ((v & 0x0F0F0F0F) << 4);
+	v = ((v >> 8) & 0x00FF00FF) | ((v & 0x00FF00FF) << 8);
+	return (v >> 16) | (v << 16);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// The first two dimensions of the Sobol sequence, as 32 bit fractions.
+// The first is the van der Corput sequence, the generator matrix of the
+// second has the columns v_k = v_(k-1) ^ (v_(k-1) >> 1).
+///////////////////////////////////////////////////////////////////////////
+static uint32_t sobol(uint32_t index, uint32_t dimension)
+{
+	if(dimension == 0)
+	{
+		return reverseBits(index);
+	}
+	uint32_t result = 0;
+	for(uint32_t v = 1u << 31; index != 0; index >>= 1, v ^= v >> 1)
+	{
+		if(index & 1)
+		{
+			result ^= v;
+		}
+	}
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Owen scrambling of a 32 bit fraction: every bit is flipped depending on
+// a hash of the bits above it. The Laine-Karras permutation does that for
+// the bits below, hence the reversals. Scrambling a sample index the same
+// way shuffles the order of a sequence, while keeping every power of two
+// aligned block of indices together.
+///////////////////////////////////////////////////////////////////////////
+static uint32_t nestedUniformScramble(uint32_t x, uint32_t seed)
+{
+	x = reverseBits(x);
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return reverseBits(x);
+}
+
+float RandomSampler::get(uint32_t x, uint32_t y, uint32_t sample_index, uint32_t dimension) const
+{
+	return randomSequenceValue(randomSequenceKey(pixelKey(x, y), sample_index), dimension);
+}
+
+float SobolSampler::get(uint32_t x, uint32_t y, uint32_t sample_index, uint32_t dimension) const
+{
+	// Every pair of dimensions gets its own scrambling and order, so that
+	// the pairs are not correlated with each other
+	const uint32_t seed = pcgHash(pixelKey(x, y) ^ pcgHash(dimension >> 1));
+	const uint32_t index = nestedUniformScramble(sample_index, seed);
+	return toUnitFloat(nestedUniformScramble(sobol(index, dimension & 1), pcgHash(seed + 1 + (dimension & 1))));
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Halton. Past the last prime base the dimensions are random.
+///////////////////////////////////////////////////////////////////////////
+static const uint32_t halton_bases[] = { 2,   3,   5,   7,   11,  13,  17,  19,  23,  29,  31,  37,  41,
+	                                     43,  47,  53,  59,  61,  67,  71,  73,  79,  83,  89,  97,  101,
+	                                     103, 107, 109, 113, 127, 131, 137, 139, 149, 151, 157, 163, 167,
+	                                     173, 179, 181, 191, 193, 197, 199, 211, 223, 227, 229, 233, 239,
+	                                     241, 251, 257, 263, 269, 271, 277, 281, 283, 293, 307, 311 };
+static const uint32_t num_halton_bases = sizeof(halton_bases) / sizeof(halton_bases[0]);
+
+float HaltonSampler::get(uint32_t x, uint32_t y, uint32_t sample_index, uint32_t dimension) const
+{
+	const uint32_t key = pcgHash(pixelKey(x, y));
+	if(dimension >= num_halton_bases)
+	{
+		return randomSequenceValue(randomSequenceKey(pixelKey(x, y), sample_index), dimension);
+	}
+	const uint32_t base = halton_bases[dimension];
+	const float inverse_base = 1.0f / float(base);
+	float value = randomSequenceValue(key, dimension);
+	float digit_weight = inverse_base;
+	for(uint32_t n = sample_index; n != 0; n /= base)
+	{
+		value += float(n % base) * digit_weight;
+		digit_weight *= inverse_base;
+	}
+	value -= floor(value);
+	return std::min(value, 0.99999994f);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// A 64x64 blue noise mask, made once with the void and cluster method
+// (Ulichney 1993): points are added one at a time where the Gaussian
+// filtered point density is lowest, and each gets its rank as its value.
+// The initial points are first spread out by moving the point in the
+// densest cluster to the largest void until that is the same point.
+///////////////////////////////////////////////////////////////////////////
+static const int BLUE_NOISE_SIZE = 64;
+
+static std::vector<float> generateBlueNoise()
+{
+	const int size = BLUE_NOISE_SIZE;
+	const int num_pixels = size * size;
+	const int radius = 6;
+	const float sigma = 1.9f;
+	float kernel[2 * radius + 1][2 * radius + 1];
+	for(int dy = -radius; dy <= radius; dy++)
+	{
+		for(int dx = -radius; dx <= radius; dx++)
+		{
+			kernel[dy + radius][dx + radius] = exp(-float(dx * dx + dy * dy) / (2.0f * sigma * sigma));
+		}
+	}
+	std::vector<uint8_t> points(num_pixels, 0);
+	std::vector<float> energy(num_pixels, 0.0f);
+	auto splat = [&](int p, float sign) {
+		const int px = p % size, py = p / size;
+		for(int dy = -radius; dy <= radius; dy++)
+		{
+			for(int dx = -radius; dx <= radius; dx++)
+			{
+				const int q = ((py + dy + size) % size) * size + (px + dx + size) % size;
+				energy[q] += sign * kernel[dy + radius][dx + radius];
+			}
+		}
+	};
+	auto tightestCluster = [&]() {
+		int best = -1;
+		for(int p = 0; p < num_pixels; p++)
+		{
+			if(points[p] && (best < 0 || energy[p] > energy[best]))
+			{
+				best = p;
+			}
+		}
+		return best;
+	};
+	auto largestVoid = [&]() {
+		int best = -1;
+		for(int p = 0; p < num_pixels; p++)
+		{
+			if(!points[p] && (best < 0 || energy[p] < energy[best]))
+			{
+				best = p;
+			}
+		}
+		return best;
+	};
+
+	const int num_initial = num_pixels / 10;
+	for(int i = 0, n = 0; n < num_initial; i++)
+	{
+		const int p = int(pcgHash(uint32_t(i)) % uint32_t(num_pixels));
+		if(!points[p])
+		{
+			points[p] = 1;
+			splat(p, 1.0f);
+			n++;
+		}
+	}
+	for(;;)
+	{
+		const int cluster = tightestCluster();
+		points[cluster] = 0;
+		splat(cluster, -1.0f);
+		const int hole = largestVoid();
+		points[hole] = 1;
+		splat(hole, 1.0f);
+		if(hole == cluster)
+		{
+			break;
+		}
+	}
+
+	std::vector<int> rank(num_pixels);
+	{
+		// Rank the initial points from the densest cluster down, on a copy
+		std::vector<uint8_t> initial_points = points;
+		std::vector<float> initial_energy = energy;
+		for(int r = num_initial - 1; r >= 0; r--)
+		{
+			const int cluster = tightestCluster();
+			points[cluster] = 0;
+			splat(cluster, -1.0f);
+			rank[cluster] = r;
+		}
+		points.swap(initial_points);
+		energy.swap(initial_energy);
+	}
+	for(int r = num_initial; r < num_pixels; r++)
+	{
+		const int hole = largestVoid();
+		points[hole] = 1;
+		splat(hole, 1.0f);
+		rank[hole] = r;
+	}
+
+	std::vector<float> mask(num_pixels);
+	for(int p = 0; p < num_pixels; p++)
+	{
+		mask[p] = (float(rank[p]) + 0.5f) / float(num_pixels);
+	}
+	return mask;
+}
+
+float BlueNoiseSampler::get(uint32_t x, uint32_t y, uint32_t sample_index, uint32_t dimension) const
+{
+	static const std::vector<float> mask = generateBlueNoise();
+	// Each dimension reads the mask at another offset, so that dimensions
+	// are not correlated
+	const uint32_t offset = pcgHash(dimension);
+	const uint32_t mx = (x + offset) % BLUE_NOISE_SIZE;
+	const uint32_t my = (y + (offset >> 16)) % BLUE_NOISE_SIZE;
+	const uint32_t pair_seed = pcgHash(dimension >> 1);
+	const uint32_t index = nestedUniformScramble(sample_index, pair_seed);
+	float value =
+	    toUnitFloat(nestedUniformScramble(sobol(index, dimension & 1), pcgHash(pair_seed + 1 + (dimension & 1))));
+	value += mask[my * BLUE_NOISE_SIZE + mx];
+	value -= floor(value);
+	return std::min(value, 0.99999994f);
+}
+
+const Sampler& getSampler(int type)
+{
+	static const RandomSampler random_sampler;
+	static const SobolSampler sobol_sampler;
+	static const HaltonSampler halton_sampler;
+	static const BlueNoiseSampler blue_noise_sampler;
+	switch(type)
+	{
+	case SOBOL_SAMPLER:
+		return sobol_sampler;
+	case HALTON_SAMPLER:
+		return halton_sampler;
+	case BLUE_NOISE_SAMPLER:
+		return blue_noise_sampler;
+	default:
+		return random_sampler;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// The sample of the path being traced on this thread. With the random
+// sampler (null), the sequence key is hashed once per path instead of per
+// dimension.
+///////////////////////////////////////////////////////////////////////////
+static const Sampler* current_sampler = nullptr;
+
+struct RandomSequence
+{
+	uint32_t x = 0, y = 0, sample_index = 0;
+	uint32_t key = 0;
+	uint32_t dimension = 0;
+};
+thread_local RandomSequence random_sequence;
+
+void setSampler(int type)
+{
+	current_sampler = type == RANDOM_SAMPLER ? nullptr : &getSampler(type);
+}
+
+void seedRandom(uint32_t x, uint32_t y, uint32_t sample_index, uint32_t dimension)
+{
+	random_sequence.x = x;
+	random_sequence.y = y;
+	random_sequence.sample_index = sample_index;
+	random_sequence.key = randomSequenceKey(pixelKey(x, y), sample_index);
+	random_sequence.dimension = dimension;
+}
+
+uint32_t getRandomDimension()
+{
+	return random_sequence.dimension;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
-// Get a random float. Note that we need one "generator" per thread, or we
-// would need to lock everytime someone called randf().
+// Get a random float in [0, 1)
 ///////////////////////////////////////////////////////////////////////////////
-std::mt19937 generators[24]; // Assuming no more than 24 cores
 float randf()
 {
-	return float(generators[omp_get_thread_num()]() / double(generators[omp_get_thread_num()].max()));
+	RandomSequence& r = random_sequence;
+	if(current_sampler)
+	{
+		return current_sampler->get(r.x, r.y, r.sample_index, r.dimension++);
+	}
+	return randomSequenceValue(r.key, r.dimension++);
+}
+
+glm::vec2 randf2()
+{
+	random_sequence.dimension += random_sequence.dimension & 1;
+	const float u1 = randf();
+	const float u2 = randf();
+	return glm::vec2(u1, u2);
 }
 
 ///////////////////////////////////////////////////////////////////////////
 // Generate uniform points on a disc
 ///////////////////////////////////////////////////////////////////////////
 glm::vec2 concentricSampleDisk()
+{
+	return concentricSampleDisk(randf2());
+}
+
+glm::vec2 concentricSampleDisk(const glm::vec2& u)
 {
 	float r, theta;
-	float u1 = randf();
-	float u2 = randf();
 	// Map uniform random numbers to $[-1,1]^2$
-	float sx = 2 * u1 - 1;
-	float sy = 2 * u2 - 1;
+	float sx = 2 * u.x - 1;
+	float sy = 2 * u.y - 1;
 	// Map square to $(r,\theta)$
 	// Handle degeneracy at the origin
 	if(sx == 0.0 && sy == 0.0)
@@ -69,6 +369,16 @@ glm::vec2 concentricSampleDisk()
 	return r * glm::vec2(cosf(theta), sinf(theta));
 }
 
+///////////////////////////////////////////////////////////////////////////
+// The square root warp: u.x picks the distance from the first corner, which
+// the area grows with the square of, and u.y the point across
+///////////////////////////////////////////////////////////////////////////
+glm::vec3 uniformSampleTriangle(const glm::vec2& u)
+{
+	const float s = sqrt(u.x);
+	return glm::vec3(1.0f - s, s * (1.0f - u.y), s * u.y);
+}
+
 ///////////////////////////////////////////////////////////////////////////
 // Generate points with a cosine distribution on the hemisphere
 ///////////////////////////////////////////////////////////////////////////
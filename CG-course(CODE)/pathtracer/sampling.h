@@ -1,17 +1,134 @@
 #pragma once
 #include <glm/glm.hpp>
+#include <cstdint>
 
 namespace pathtracer
 {
 ///////////////////////////////////////////////////////////////////////////
-// Random number generation
+// A counter based generator: the n'th number of a sequence is a hash of the
+// sequence key and n, so there is no generator state to share or to keep
+// per core. The hash is the PCG output permutation, see "Hash Functions for
+// GPU Rendering" (Jarzynski & Olano, 2020). These are inline so that loops
+// over many sequences (e.g. the camera's) can be vectorized.
 ///////////////////////////////////////////////////////////////////////////
+inline uint32_t pcgHash(uint32_t v)
+{
+	uint32_t state = v * 747796405u + 2891336453u;
+	uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+	return (word >> 22u) ^ word;
+}
+
+// A unique number per pixel, for images up to 65536 pixels wide
+inline uint32_t pixelKey(uint32_t x, uint32_t y)
+{
+	return (y << 16) | (x & 0xFFFF);
+}
+
+// The key of the sequence of one path
+inline uint32_t randomSequenceKey(uint32_t pixel_key, uint32_t sample_index)
+{
+	return pcgHash(pcgHash(pixel_key) + sample_index);
+}
+
+// One dimension of a sequence, in [0, 1). The dimension is hashed before
+// it is mixed in, or sequences whose keys are close would be shifted
+// copies of each other.
+inline float randomSequenceValue(uint32_t key, uint32_t dimension)
+{
+	return float(pcgHash(key ^ pcgHash(dimension)) >> 8) * (1.0f / 16777216.0f);
+}
+
+// The first dimensions of every path are used by the camera, for the
+// sub-pixel position and the lens position. Paths start at the next one.
+const uint32_t CAMERA_RANDOM_DIMENSIONS = 4;
+
+///////////////////////////////////////////////////////////////////////////
+// Samplers hand out dimension d of sample n of a pixel. Since the values
+// are a function of (pixel, sample, dimension) only, any thread can draw
+// them in any order.
+//   RandomSampler    - independent random numbers, the hash above.
+//   SobolSampler     - each pair of dimensions is a 2D Sobol sequence with
+//                      hash based Owen scrambling and a shuffled order per
+//                      pixel ("Practical Hash-based Owen Scrambling",
+//                      Burley 2020). Any power of two first samples of a
+//                      pixel are stratified in every pair.
+//   HaltonSampler    - dimension d is the radical inverse in the d'th prime
+//                      base, rotated (Cranley-Patterson) per pixel.
+//   BlueNoiseSampler - one Sobol sequence for all pixels, rotated per pixel
+//                      by a blue noise mask ("Blue-noise Dithered Sampling",
+//                      Georgiev & Fajardo 2016). The error of neighbouring
+//                      pixels is then anticorrelated, which looks less noisy
+//                      at low sample counts.
+///////////////////////////////////////////////////////////////////////////
+enum SamplerType
+{
+	RANDOM_SAMPLER,
+	SOBOL_SAMPLER,
+	HALTON_SAMPLER,
+	BLUE_NOISE_SAMPLER,
+	NUM_SAMPLER_TYPES
+};
+extern const char* sampler_names[NUM_SAMPLER_TYPES];
+
+class Sampler
+{
+public:
+	// Dimension `dimension` of sample `sample_index` of pixel (x, y), in [0, 1)
+	virtual float get(uint32_t x, uint32_t y, uint32_t sample_index, uint32_t dimension) const = 0;
+};
+
+class RandomSampler : public Sampler
+{
+public:
+	virtual float get(uint32_t x, uint32_t y, uint32_t sample_index, uint32_t dimension) const override;
+};
+
+class SobolSampler : public Sampler
+{
+public:
+	virtual float get(uint32_t x, uint32_t y, uint32_t sample_index, uint32_t dimension) const override;
+};
+
+class HaltonSampler : public Sampler
+{
+public:
+	virtual float get(uint32_t x, uint32_t y, uint32_t sample_index, uint32_t dimension) const override;
+};
+
+class BlueNoiseSampler : public Sampler
+{
+public:
+	virtual float get(uint32_t x, uint32_t y, uint32_t sample_index, uint32_t dimension) const override;
+};
+
+const Sampler& getSampler(int type);
+
+///////////////////////////////////////////////////////////////////////////
+// Random number generation. Call seedRandom() before tracing a new path;
+// each randf() call on the thread then returns the next dimension of that
+// path's sample, from the sampler chosen with setSampler() (call it when
+// nothing is being traced). A path that is put aside can be resumed by
+// seeding with the dimension it had reached.
+///////////////////////////////////////////////////////////////////////////
+void setSampler(int type);
+void seedRandom(uint32_t x, uint32_t y, uint32_t sample_index, uint32_t dimension = 0);
+uint32_t getRandomDimension();
 float randf();
+// Two random numbers for a 2D sample. The Sobol and blue noise samplers are
+// stratified in the pairs of dimensions (2k, 2k + 1), so an odd dimension is
+// skipped to start on a pair.
+glm::vec2 randf2();
 
 ///////////////////////////////////////////////////////////////////////////
-// Generate uniform points on a disc
+// Generate uniform points on a disc, from two random numbers or from u
 ///////////////////////////////////////////////////////////////////////////
 glm::vec2 concentricSampleDisk();
+glm::vec2 concentricSampleDisk(const glm::vec2& u);
+
+///////////////////////////////////////////////////////////////////////////
+// The barycentric coordinates of a uniform point on a triangle
+///////////////////////////////////////////////////////////////////////////
+glm::vec3 uniformSampleTriangle(const glm::vec2& u);
 
 ///////////////////////////////////////////////////////////////////////////
 // Generate points with a cosine distribution on the hemisphere